@@ -6,55 +6,3732 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <map>
+#include <cstring>
 #include <filesystem>
 #include <future>
+#include <list>
+#include <deque>
+#include <chrono>
+#include <iomanip>
+#include <type_traits>
+#include <string_view>
+#include <bitset>
+#include <limits>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <random>
+#include <functional>
+
+#if defined(HAVE_LZ4)
+#include <lz4.h>
+#endif
+
+#if defined(HAVE_JPEG)
+#include <cstdio>
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+
+#if defined(WINDOWS)
+#define NOMINMAX
+#include <windows.h>
+#elif defined(UNIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "argparse.hpp"
 #include "indicators.hpp"
 
-#if defined(WINDOWS)
-#define strcasecmp _strcmpi
-#endif
+#if defined(WINDOWS)
+#define strcasecmp _strcmpi
+#endif
+
+// Kernels whose loops vectorize are compiled once per instruction set level and picked at runtime, so one binary runs at
+// full speed on every host. Only GCC and Clang can target an instruction set per function, other compilers get the
+// baseline build
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_MULTIVERSIONING
+#include <immintrin.h>
+#define KERNEL_TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+#define KERNEL_TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#define KERNEL_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx2,popcnt")))
+// Not every AVX-512 host has the vector popcount, so the Hamming scan checks for it separately
+#define KERNEL_TARGET_AVX512_POPCNT __attribute__((target("avx512f,avx512bw,avx512vl,avx512vpopcntdq,avx2,popcnt")))
+// Portable kernel bodies are force-inlined into each target variant so the compiler vectorizes the same source for the
+// wider registers of that level
+#define KERNEL_INLINE __attribute__((always_inline)) inline
+// Defines Name##Sse42, Name##Avx2 and Name##Avx512 around the portable body Name. The template head and the call are
+// parenthesized so their commas survive the macro: () and (<T>(row1, row2, pixels)) for example
+#define KERNEL_UNPAREN(...) __VA_ARGS__
+#define MULTIVERSION_KERNEL(templateHead, Return, Name, parameters, call) \
+    KERNEL_UNPAREN templateHead KERNEL_TARGET_SSE42 Return Name##Sse42 parameters { return Name KERNEL_UNPAREN call; } \
+    KERNEL_UNPAREN templateHead KERNEL_TARGET_AVX2 Return Name##Avx2 parameters { return Name KERNEL_UNPAREN call; } \
+    KERNEL_UNPAREN templateHead KERNEL_TARGET_AVX512 Return Name##Avx512 parameters { return Name KERNEL_UNPAREN call; }
+// The variant of a MULTIVERSION_KERNEL for this host as a Kernel pointer, templateArgs is () or (<T, ...>)
+#define SELECT_KERNEL(Kernel, Name, templateArgs) \
+    selectKernel<Kernel>(Name KERNEL_UNPAREN templateArgs, Name##Sse42 KERNEL_UNPAREN templateArgs, Name##Avx2 KERNEL_UNPAREN templateArgs, Name##Avx512 KERNEL_UNPAREN templateArgs)
+#else
+#define KERNEL_INLINE inline
+#define KERNEL_UNPAREN(...) __VA_ARGS__
+#define MULTIVERSION_KERNEL(templateHead, Return, Name, parameters, call)
+#define SELECT_KERNEL(Kernel, Name, templateArgs) static_cast<Kernel>(Name KERNEL_UNPAREN templateArgs)
+#endif
+
+enum class CpuLevel { Baseline, Sse42, Avx2, Avx512 };
+
+const char* cpuLevelName(const CpuLevel level) {
+    switch (level) {
+        case CpuLevel::Avx512: return "avx512";
+        case CpuLevel::Avx2: return "avx2";
+        case CpuLevel::Sse42: return "sse4.2";
+        default: return "baseline";
+    }
+}
+
+// Detected once (OpenCV runs cpuid and checks OS support for the wider registers), every kernel lookup after that is a
+// plain switch
+CpuLevel cpuLevel() {
+    static const CpuLevel level = []() {
+#if defined(KERNEL_MULTIVERSIONING)
+        if (cv::checkHardwareSupport(CV_CPU_AVX_512F) && cv::checkHardwareSupport(CV_CPU_AVX_512BW) && cv::checkHardwareSupport(CV_CPU_AVX_512VL)) {
+            return CpuLevel::Avx512;
+        }
+        if (cv::checkHardwareSupport(CV_CPU_AVX2) && cv::checkHardwareSupport(CV_CPU_POPCNT)) {
+            return CpuLevel::Avx2;
+        }
+        if (cv::checkHardwareSupport(CV_CPU_SSE4_2) && cv::checkHardwareSupport(CV_CPU_POPCNT)) {
+            return CpuLevel::Sse42;
+        }
+#endif
+        return CpuLevel::Baseline;
+    }();
+    return level;
+}
+
+// Kernel is spelled out rather than deduced since the portable bodies share their names with overloads
+template <typename Kernel>
+Kernel selectKernel(const Kernel baseline, const Kernel sse42, const Kernel avx2, const Kernel avx512) {
+    switch (cpuLevel()) {
+        case CpuLevel::Avx512: return avx512;
+        case CpuLevel::Avx2: return avx2;
+        case CpuLevel::Sse42: return sse42;
+        default: return baseline;
+    }
+}
+
+// Counts positions where both rows hold identical elements. Elements are compared as unsigned integers of their own
+// width, so a 16-bit sample that differs only in its low byte is one differing element and float data is compared
+// bit-exactly. The channel count is a template parameter so the inner loop unrolls without any per-pixel branching
+template <typename T, int Channels>
+KERNEL_INLINE size_t countEqualElements(const uchar* row1, const uchar* row2, const int pixels) {
+    const T* a = reinterpret_cast<const T*>(row1);
+    const T* b = reinterpret_cast<const T*>(row2);
+    size_t equal = 0;
+    for (int x = 0; x < pixels; ++x) {
+        for (int c = 0; c < Channels; ++c) {
+            equal += a[x * Channels + c] == b[x * Channels + c];
+        }
+    }
+    return equal;
+}
+
+MULTIVERSION_KERNEL((template <typename T, int Channels>), size_t, countEqualElements, (const uchar* row1, const uchar* row2, const int pixels), (<T, Channels>(row1, row2, pixels)))
+
+using EqualElementsKernel = size_t (*)(const uchar*, const uchar*, int);
+
+template <typename T, int Channels>
+EqualElementsKernel equalElementsVariant() {
+    return SELECT_KERNEL(EqualElementsKernel, countEqualElements, (<T, Channels>));
+}
+
+template <typename T>
+EqualElementsKernel equalElementsKernel(const int channels) {
+    switch (channels) {
+        case 1: return equalElementsVariant<T, 1>();
+        case 2: return equalElementsVariant<T, 2>();
+        case 3: return equalElementsVariant<T, 3>();
+        case 4: return equalElementsVariant<T, 4>();
+        default: return nullptr;
+    }
+}
+
+// Picks the kernel instantiation for an OpenCV type, NULL for types cv::imread never produces (more than 4 channels)
+EqualElementsKernel equalElementsKernel(const int type) {
+    switch (CV_MAT_DEPTH(type)) {
+        case CV_8U:
+        case CV_8S:
+            return equalElementsKernel<uint8_t>(CV_MAT_CN(type));
+        case CV_16U:
+        case CV_16S:
+        case CV_16F:
+            return equalElementsKernel<uint16_t>(CV_MAT_CN(type));
+        case CV_32S:
+        case CV_32F:
+            return equalElementsKernel<uint32_t>(CV_MAT_CN(type));
+        default:
+            return equalElementsKernel<uint64_t>(CV_MAT_CN(type));
+    }
+}
+
+// Same count as countEqualElements, except that pixels with alpha 0 in both images count as equal (branch-free)
+template <typename T, int Channels>
+KERNEL_INLINE size_t countEqualVisibleElements(const uchar* row1, const uchar* row2, const int pixels) {
+    const T* a = reinterpret_cast<const T*>(row1);
+    const T* b = reinterpret_cast<const T*>(row2);
+    size_t equal = 0;
+    for (int x = 0; x < pixels; ++x) {
+        const int transparent = (a[x * Channels + Channels - 1] | b[x * Channels + Channels - 1]) == 0;
+        for (int c = 0; c < Channels; ++c) {
+            equal += (a[x * Channels + c] == b[x * Channels + c]) | transparent;
+        }
+    }
+    return equal;
+}
+
+MULTIVERSION_KERNEL((template <typename T, int Channels>), size_t, countEqualVisibleElements, (const uchar* row1, const uchar* row2, const int pixels), (<T, Channels>(row1, row2, pixels)))
+
+template <typename T, int Channels>
+EqualElementsKernel equalVisibleVariant() {
+    return SELECT_KERNEL(EqualElementsKernel, countEqualVisibleElements, (<T, Channels>));
+}
+
+template <typename T>
+EqualElementsKernel equalVisibleKernel(const int channels) {
+    switch (channels) {
+        case 2: return equalVisibleVariant<T, 2>();
+        case 4: return equalVisibleVariant<T, 4>();
+        default: return equalElementsKernel<T>(channels);
+    }
+}
+
+// Alpha-aware counterpart of equalElementsKernel for gray+alpha and RGBA images, other layouts have no alpha to
+// look at and get the plain kernel
+EqualElementsKernel equalVisibleKernel(const int type) {
+    switch (CV_MAT_DEPTH(type)) {
+        case CV_8U: return equalVisibleKernel<uint8_t>(CV_MAT_CN(type));
+        case CV_16U: return equalVisibleKernel<uint16_t>(CV_MAT_CN(type));
+        case CV_32F: return equalVisibleKernel<uint32_t>(CV_MAT_CN(type));
+        default: return equalElementsKernel(type);
+    }
+}
+
+// Sample c of a pixel with Channels channels, scaled to 8 bits. Gray (with or without alpha) repeats its one value for
+// every colour channel. 16-bit samples keep their high byte, which turns an 8-bit image widened by 257 back exactly
+template <typename T, int Channels>
+KERNEL_INLINE uint8_t convertedSample(const T* pixel, const int c) {
+    return (uint8_t)(pixel[Channels < 3 ? 0 : c] >> (8 * (sizeof(T) - 1)));
+}
+
+// Alpha of a pixel scaled to 8 bits, layouts without one are opaque
+template <typename T, int Channels>
+KERNEL_INLINE uint8_t convertedAlpha(const T* pixel) {
+    if constexpr (Channels == 2 || Channels == 4) {
+        return (uint8_t)(pixel[Channels - 1] >> (8 * (sizeof(T) - 1)));
+    }
+    else {
+        return 255;
+    }
+}
+
+// Colour channels and whether there's an alpha channel once two layouts are compared in a common format
+constexpr int convertedColours(const int channels1, const int channels2) {
+    return channels1 >= 3 || channels2 >= 3 ? 3 : 1;
+}
+
+constexpr bool convertedHasAlpha(const int channels1, const int channels2) {
+    return channels1 == 2 || channels1 == 4 || channels2 == 2 || channels2 == 4;
+}
+
+// Counts equal elements between rows of two different types by converting each pixel to 8-bit gray/BGR plus alpha in
+// registers: gray is expanded, a missing alpha is opaque and 16-bit samples are narrowed. So a copy saved as RGB, opaque
+// RGBA, gray or 16-bit matches the original without a converted Mat being made for either side
+template <typename T1, int Channels1, typename T2, int Channels2>
+KERNEL_INLINE size_t countEqualConvertedElements(const uchar* row1, const uchar* row2, const int pixels) {
+    constexpr int colours = convertedColours(Channels1, Channels2);
+    const T1* a = reinterpret_cast<const T1*>(row1);
+    const T2* b = reinterpret_cast<const T2*>(row2);
+    size_t equal = 0;
+    for (int x = 0; x < pixels; ++x) {
+        for (int c = 0; c < colours; ++c) {
+            equal += convertedSample<T1, Channels1>(a + x * Channels1, c) == convertedSample<T2, Channels2>(b + x * Channels2, c);
+        }
+        if constexpr (convertedHasAlpha(Channels1, Channels2)) {
+            equal += convertedAlpha<T1, Channels1>(a + x * Channels1) == convertedAlpha<T2, Channels2>(b + x * Channels2);
+        }
+    }
+    return equal;
+}
+
+MULTIVERSION_KERNEL((template <typename T1, int Channels1, typename T2, int Channels2>), size_t, countEqualConvertedElements, (const uchar* row1, const uchar* row2, const int pixels), (<T1, Channels1, T2, Channels2>(row1, row2, pixels)))
+
+template <typename T1, int Channels1, typename T2, int Channels2>
+EqualElementsKernel equalConvertedVariant() {
+    return SELECT_KERNEL(EqualElementsKernel, countEqualConvertedElements, (<T1, Channels1, T2, Channels2>));
+}
+
+template <typename T1, int Channels1, typename T2>
+EqualElementsKernel equalConvertedKernel(const int channels2) {
+    switch (channels2) {
+        case 1: return equalConvertedVariant<T1, Channels1, T2, 1>();
+        case 2: return equalConvertedVariant<T1, Channels1, T2, 2>();
+        case 3: return equalConvertedVariant<T1, Channels1, T2, 3>();
+        case 4: return equalConvertedVariant<T1, Channels1, T2, 4>();
+        default: return nullptr;
+    }
+}
+
+template <typename T1, int Channels1>
+EqualElementsKernel equalConvertedKernel(const int type2) {
+    switch (CV_MAT_DEPTH(type2)) {
+        case CV_8U: return equalConvertedKernel<T1, Channels1, uint8_t>(CV_MAT_CN(type2));
+        case CV_16U: return equalConvertedKernel<T1, Channels1, uint16_t>(CV_MAT_CN(type2));
+        default: return nullptr;
+    }
+}
+
+template <typename T1>
+EqualElementsKernel equalConvertedKernel(const int channels1, const int type2) {
+    switch (channels1) {
+        case 1: return equalConvertedKernel<T1, 1>(type2);
+        case 2: return equalConvertedKernel<T1, 2>(type2);
+        case 3: return equalConvertedKernel<T1, 3>(type2);
+        case 4: return equalConvertedKernel<T1, 4>(type2);
+        default: return nullptr;
+    }
+}
+
+// Kernel comparing images of two different 8/16-bit layouts, NULL for any other depth
+EqualElementsKernel equalConvertedKernel(const int type1, const int type2) {
+    switch (CV_MAT_DEPTH(type1)) {
+        case CV_8U: return equalConvertedKernel<uint8_t>(CV_MAT_CN(type1), type2);
+        case CV_16U: return equalConvertedKernel<uint16_t>(CV_MAT_CN(type1), type2);
+        default: return nullptr;
+    }
+}
+
+// Elements per pixel the converted kernel compares
+int convertedElements(const int type1, const int type2) {
+    return convertedColours(CV_MAT_CN(type1), CV_MAT_CN(type2)) + (convertedHasAlpha(CV_MAT_CN(type1), CV_MAT_CN(type2)) ? 1 : 0);
+}
+
+// Samples within the tolerance of each other, and the sums of absolute and squared differences over every sample
+struct ErrorSums {
+    uint64_t close = 0, absolute = 0, squared = 0;
+};
+
+// Counts samples with |a - b| <= tolerance and accumulates the error sums in the same pass. Channels don't matter to
+// any of the three, so the row is treated as one run of samples. 8-bit rows are summed in 32-bit lanes over chunks
+// short enough that 255^2 per sample can't overflow them, which keeps twice as many lanes per register as 64-bit sums
+template <typename T>
+KERNEL_INLINE void accumulateErrors(const uchar* row1, const uchar* row2, const size_t samples, const uint32_t tolerance, ErrorSums& sums) {
+    using Sum = std::conditional_t<sizeof(T) == 1, uint32_t, uint64_t>;
+    const size_t chunk = sizeof(T) == 1 ? 65536 : samples;
+    const T* a = reinterpret_cast<const T*>(row1);
+    const T* b = reinterpret_cast<const T*>(row2);
+    for (size_t start = 0; start < samples; start += chunk) {
+        const size_t end = std::min(start + chunk, samples);
+        Sum close = 0, absolute = 0, squared = 0;
+        for (size_t i = start; i < end; ++i) {
+            const Sum difference = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+            close += difference <= tolerance;
+            absolute += difference;
+            squared += difference * difference;
+        }
+        sums.close += close;
+        sums.absolute += absolute;
+        sums.squared += squared;
+    }
+}
+
+MULTIVERSION_KERNEL((template <typename T>), void, accumulateErrors, (const uchar* row1, const uchar* row2, const size_t samples, const uint32_t tolerance, ErrorSums& sums), (<T>(row1, row2, samples, tolerance, sums)))
+
+using ErrorKernel = void (*)(const uchar*, const uchar*, size_t, uint32_t, ErrorSums&);
+
+template <typename T>
+ErrorKernel errorVariant() {
+    return SELECT_KERNEL(ErrorKernel, accumulateErrors, (<T>));
+}
+
+// Only unsigned integer depths have a meaningful tolerance and peak value, NULL for the rest (those are compared exactly)
+ErrorKernel errorKernel(const int type) {
+    switch (CV_MAT_DEPTH(type)) {
+        case CV_8U: return errorVariant<uint8_t>();
+        case CV_16U: return errorVariant<uint16_t>();
+        default: return nullptr;
+    }
+}
+
+// 64-bit multiply-xorshift hash over four independent 8-byte lanes, so instruction-level parallelism keeps up with
+// running it over every decoded byte once per file. Nothing below AVX-512DQ multiplies 64-bit lanes, so it is one
+// scalar build for every host
+uint64_t hashBytes(const uchar* data, const size_t length, const uint64_t seed) {
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+    uint64_t lanes[4] = {seed, seed + multiplier, seed + 2 * multiplier, seed + 3 * multiplier};
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        for (int l = 0; l < 4; ++l) {
+            uint64_t word;
+            std::memcpy(&word, data + i + 8 * l, 8);
+            word *= multiplier;
+            word ^= word >> 32;
+            lanes[l] = (lanes[l] ^ word) * multiplier;
+        }
+    }
+    uint64_t hash = seed ^ (length * multiplier);
+    for (int l = 0; l < 4; ++l) {
+        hash = (hash ^ lanes[l]) * multiplier;
+    }
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * multiplier;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, length - i);
+    hash = (hash ^ tail) * multiplier;
+    return hash ^ (hash >> 29);
+}
+
+KERNEL_INLINE int popcount64(const uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(value);
+#else
+    return (int)std::bitset<64>(value).count();
+#endif
+}
+
+// AVX-512 hosts that can also popcount whole vectors
+bool hasVectorPopcount() {
+#if defined(KERNEL_MULTIVERSIONING)
+    static const bool supported = cpuLevel() == CpuLevel::Avx512 && cv::checkHardwareSupport(CV_CPU_AVX_512VPOPCNTDQ);
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Prints what each kernel runs as on this host (--cpu-features). Loops that vectorize are multi-versioned, the scalar
+// searches only get a POPCNT variant
+void printCpuFeatures() {
+    const char* level = cpuLevelName(cpuLevel());
+#if defined(__POPCNT__)
+    const char* builtPopcount = "popcnt";
+#else
+    const char* builtPopcount = "software popcount";
+#endif
+    const char* scanPopcount = hasVectorPopcount() ? "vpopcntdq" : cpuLevel() >= CpuLevel::Avx2 ? "pshufb nibble lookup" : cpuLevel() == CpuLevel::Sse42 ? "popcnt" : builtPopcount;
+    std::cout << "Host level: " << level << "\n";
+#if !defined(KERNEL_MULTIVERSIONING)
+    std::cout << "(this build has no multi-versioned kernels, the baseline is always used)\n";
+#endif
+    std::cout << "  Pixel comparison and error metrics: " << level << "\n";
+    std::cout << "  Thumbnail comparison (--scale-normalized): " << level << "\n";
+    std::cout << "  Vector search dot product: " << level << "\n";
+    std::cout << "  Hamming scan: " << level << " (" << scanPopcount << ")\n";
+    std::cout << "  BK-tree search: " << (cpuLevel() >= CpuLevel::Sse42 ? "sse4.2 (popcnt)" : builtPopcount) << "\n";
+    std::cout << "  Multi-index search: " << level << " (" << scanPopcount << ")\n";
+    std::cout << "  Tile and container hashing: single build (scalar 64-bit multiplies)\n";
+    std::cout << "  SSIM: " << level << "\n";
+    std::cout << "  Resizing and decoding: OpenCV's own dispatch (" << cv::getCPUFeaturesLine() << ")\n";
+}
+
+// Number of equal elements between two decoded images of the same size and type
+size_t countEqualElements(const cv::Mat& image1Mat, const cv::Mat& image2Mat, const EqualElementsKernel kernel) {
+    size_t equal = 0;
+    for (int y = 0; y < image1Mat.rows; ++y) {
+        equal += kernel(image1Mat.ptr<uchar>(y), image2Mat.ptr<uchar>(y), image1Mat.cols);
+    }
+    return equal;
+}
+
+// Error sums between two decoded images of the same size and type
+ErrorSums accumulateErrors(const cv::Mat& image1Mat, const cv::Mat& image2Mat, const ErrorKernel kernel, const uint32_t tolerance) {
+    ErrorSums sums;
+    const size_t samples = (size_t)image1Mat.cols * image1Mat.channels();
+    for (int y = 0; y < image1Mat.rows; ++y) {
+        kernel(image1Mat.ptr<uchar>(y), image2Mat.ptr<uchar>(y), samples, tolerance, sums);
+    }
+    return sums;
+}
+
+// SSIM is taken over every 8x8 window, in strips of windows narrow enough for their running sums to stay in L1/L2
+const int ssimWindow = 8, ssimStripWindows = 256;
+
+// Column and window sums of the SSIM kernel (32-bit for 8-bit images, whose squares over a window can't overflow them)
+// and the per-row window moments, reused between pairs
+struct SsimScratch {
+    std::vector<int32_t> narrowSums;
+    std::vector<int64_t> wideSums;
+    std::vector<double> moments;
+};
+
+template <typename T>
+auto& ssimSums(SsimScratch& scratch) {
+    if constexpr (sizeof(T) == 1) {
+        return scratch.narrowSums;
+    }
+    else {
+        return scratch.wideSums;
+    }
+}
+
+// Sum of the SSIM of count windows from their moments, in eight partial sums so the loop vectorizes
+KERNEL_INLINE double sumWindowSsim(const double* meanA, const double* meanB, const double* varianceA, const double* varianceB, const double* covariance, const size_t count, const double c1, const double c2) {
+    double sums[8] = {};
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        for (int lane = 0; lane < 8; ++lane) {
+            const size_t w = i + lane;
+            sums[lane] += ((2 * meanA[w] * meanB[w] + c1) * (2 * covariance[w] + c2)) / ((meanA[w] * meanA[w] + meanB[w] * meanB[w] + c1) * (varianceA[w] + varianceB[w] + c2));
+        }
+    }
+    for (; i < count; ++i) {
+        sums[0] += ((2 * meanA[i] * meanB[i] + c1) * (2 * covariance[i] + c2)) / ((meanA[i] * meanA[i] + meanB[i] * meanB[i] + c1) * (varianceA[i] + varianceB[i] + c2));
+    }
+    return ((sums[0] + sums[4]) + (sums[1] + sums[5])) + ((sums[2] + sums[6]) + (sums[3] + sums[7]));
+}
+
+// Mean SSIM over every window and channel, returning the upper bound early once the threshold is out of reach
+template <typename T>
+KERNEL_INLINE double structuralSimilarity(const cv::Mat& image1Mat, const cv::Mat& image2Mat, const double threshold, SsimScratch& scratch) {
+    using Sum = std::conditional_t<sizeof(T) == 1, int32_t, int64_t>;
+    const int channels = image1Mat.channels();
+    const int window = std::min({ssimWindow, image1Mat.rows, image1Mat.cols});
+    const int windowRows = image1Mat.rows - window + 1, windowCols = image1Mat.cols - window + 1;
+    const double inverseArea = 1.0 / ((double)window * window), peak = std::numeric_limits<T>::max();
+    const double c1 = (0.01 * peak) * (0.01 * peak), c2 = (0.03 * peak) * (0.03 * peak);
+    const double total = (double)windowRows * windowCols * channels;
+    const size_t stripSamples = (size_t)(ssimStripWindows + window - 1) * channels, stripLanes = (size_t)ssimStripWindows * channels;
+    auto& sums = ssimSums<T>(scratch);
+    sums.resize(5 * (stripSamples + stripLanes));
+    scratch.moments.resize(5 * stripLanes);
+    Sum* columns[5];
+    Sum* windows[5];
+    double* moments[5];
+    for (int k = 0; k < 5; ++k) {
+        columns[k] = sums.data() + k * stripSamples;
+        windows[k] = sums.data() + 5 * stripSamples + k * stripLanes;
+        moments[k] = scratch.moments.data() + k * stripLanes;
+    }
+    Sum* sumA = columns[0];
+    Sum* sumB = columns[1];
+    Sum* sumAA = columns[2];
+    Sum* sumBB = columns[3];
+    Sum* sumAB = columns[4];
+
+    double score = 0, scored = 0;
+    for (int left = 0; left < windowCols; left += ssimStripWindows) {
+        const int stripWindows = std::min(ssimStripWindows, windowCols - left);
+        const size_t samples = (size_t)(stripWindows + window - 1) * channels, lanes = (size_t)stripWindows * channels;
+        std::fill(sums.begin(), sums.begin() + 5 * stripSamples, 0);
+        for (int y = 0; y < image1Mat.rows; ++y) {
+            const T* a = image1Mat.ptr<T>(y) + (size_t)left * channels;
+            const T* b = image2Mat.ptr<T>(y) + (size_t)left * channels;
+            if (y >= window) {
+                const T* oldA = image1Mat.ptr<T>(y - window) + (size_t)left * channels;
+                const T* oldB = image2Mat.ptr<T>(y - window) + (size_t)left * channels;
+                for (size_t i = 0; i < samples; ++i) {
+                    const Sum newA = a[i], newB = b[i], droppedA = oldA[i], droppedB = oldB[i];
+                    sumA[i] += newA - droppedA;
+                    sumB[i] += newB - droppedB;
+                    sumAA[i] += newA * newA - droppedA * droppedA;
+                    sumBB[i] += newB * newB - droppedB * droppedB;
+                    sumAB[i] += newA * newB - droppedA * droppedB;
+                }
+            }
+            else {
+                for (size_t i = 0; i < samples; ++i) {
+                    const Sum newA = a[i], newB = b[i];
+                    sumA[i] += newA;
+                    sumB[i] += newB;
+                    sumAA[i] += newA * newA;
+                    sumBB[i] += newB * newB;
+                    sumAB[i] += newA * newB;
+                }
+            }
+            if (y < window - 1) {
+                continue;
+            }
+
+            // Lane x * channels + c is the window starting at column x of channel c
+            for (int k = 0; k < 5; ++k) {
+                std::copy(columns[k], columns[k] + lanes, windows[k]);
+                for (int x = 1; x < window; ++x) {
+                    const Sum* column = columns[k] + (size_t)x * channels;
+                    for (size_t i = 0; i < lanes; ++i) {
+                        windows[k][i] += column[i];
+                    }
+                }
+            }
+            for (size_t i = 0; i < lanes; ++i) {
+                const double meanA = windows[0][i] * inverseArea, meanB = windows[1][i] * inverseArea;
+                moments[0][i] = meanA;
+                moments[1][i] = meanB;
+                moments[2][i] = windows[2][i] * inverseArea - meanA * meanA;
+                moments[3][i] = windows[3][i] * inverseArea - meanB * meanB;
+                moments[4][i] = windows[4][i] * inverseArea - meanA * meanB;
+            }
+            score += sumWindowSsim(moments[0], moments[1], moments[2], moments[3], moments[4], lanes, c1, c2);
+            scored += (double)lanes;
+            const double bound = (score + total - scored) / total;
+            if (bound < threshold) {
+                return bound;
+            }
+        }
+    }
+    return score / total;
+}
+
+MULTIVERSION_KERNEL((template <typename T>), double, structuralSimilarity, (const cv::Mat& image1Mat, const cv::Mat& image2Mat, const double threshold, SsimScratch& scratch), (<T>(image1Mat, image2Mat, threshold, scratch)))
+
+using SsimKernel = double (*)(const cv::Mat&, const cv::Mat&, double, SsimScratch&);
+
+template <typename T>
+SsimKernel ssimVariant() {
+    return SELECT_KERNEL(SsimKernel, structuralSimilarity, (<T>));
+}
+
+// Same depths as errorKernel, the SSIM constants are defined relative to the peak value
+SsimKernel ssimKernel(const int type) {
+    switch (CV_MAT_DEPTH(type)) {
+        case CV_8U: return ssimVariant<uint8_t>();
+        case CV_16U: return ssimVariant<uint16_t>();
+        default: return nullptr;
+    }
+}
+
+// Temporary file mapped into memory for structures that outgrow their share of --memory-budget. The file is deleted as
+// soon as it's created (UNIX) or when it's closed (Windows), so nothing is left behind if the scan is interrupted
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        unmap(data, size);
+#if defined(WINDOWS)
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+#elif defined(UNIX)
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+#endif
+    }
+
+    void* get() const {
+        return data;
+    }
+
+    // Grows (or creates) the file and maps it again. Contents are preserved, and on failure the old mapping stays valid
+    bool resize(const size_t bytes) {
+        void* mapped = nullptr;
+#if defined(WINDOWS)
+        if (file == INVALID_HANDLE_VALUE) {
+            char directory[MAX_PATH], name[MAX_PATH];
+            if (GetTempPathA(MAX_PATH, directory) == 0 || GetTempFileNameA(directory, "idd", 0, name) == 0) {
+                return false;
+            }
+            file = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+            if (file == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+        }
+        // The mapping object grows the file to its size
+        HANDLE newMapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)bytes >> 32), (DWORD)bytes, nullptr);
+        if (newMapping == nullptr) {
+            return false;
+        }
+        mapped = MapViewOfFile(newMapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+        if (mapped == nullptr) {
+            CloseHandle(newMapping);
+            return false;
+        }
+        unmap(data, size);
+        mapping = newMapping;
+#elif defined(UNIX)
+        if (descriptor < 0) {
+            std::string name = (std::filesystem::temp_directory_path() / "ImageDuplicateDetector-XXXXXX").string();
+            descriptor = mkstemp(name.data());
+            if (descriptor < 0) {
+                return false;
+            }
+            unlink(name.c_str());
+        }
+        if (ftruncate(descriptor, (off_t)bytes) != 0) {
+            return false;
+        }
+        mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        unmap(data, size);
+#endif
+        data = mapped;
+        size = bytes;
+        return data != nullptr;
+    }
+
+private:
+    void unmap(void* mapped, const size_t bytes) {
+        if (mapped == nullptr) {
+            return;
+        }
+#if defined(WINDOWS)
+        UnmapViewOfFile(mapped);
+        CloseHandle(mapping);
+        mapping = nullptr;
+#elif defined(UNIX)
+        munmap(mapped, bytes);
+#endif
+    }
+
+    void* data = nullptr;
+    size_t size = 0;
+#if defined(WINDOWS)
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#elif defined(UNIX)
+    int descriptor = -1;
+#endif
+};
+
+// Append-only array of trivially copyable records. It lives on the heap until it outgrows limitBytes (0 never spills),
+// then moves to a MappedFile so the OS can page it out instead of the scan running out of memory
+template <typename T>
+class SpillVector {
+    static_assert(std::is_trivially_copyable<T>::value, "SpillVector moves its contents as raw bytes");
+
+public:
+    explicit SpillVector(const size_t limitBytes = 0) : limitBytes(limitBytes) {}
+    SpillVector(const SpillVector&) = delete;
+    SpillVector& operator=(const SpillVector&) = delete;
+
+    void push_back(const T& value) {
+        if (count == capacity) {
+            grow();
+        }
+        items[count++] = value;
+    }
+
+    // Grows to size items, zero-filling the new ones
+    void resize(const size_t size) {
+        while (capacity < size) {
+            grow();
+        }
+        if (size > count) {
+            std::memset(static_cast<void*>(items + count), 0, (size - count) * sizeof(T));
+        }
+        count = size;
+    }
+
+    T& operator[](const size_t i) {
+        return items[i];
+    }
+    const T& operator[](const size_t i) const {
+        return items[i];
+    }
+    T* begin() {
+        return items;
+    }
+    T* end() {
+        return items + count;
+    }
+    const T* begin() const {
+        return items;
+    }
+    const T* end() const {
+        return items + count;
+    }
+    size_t size() const {
+        return count;
+    }
+    bool spilled() const {
+        return file.get() != nullptr;
+    }
+
+private:
+    void grow() {
+        const size_t newCapacity = std::max<size_t>(capacity * 2, 1024);
+        if (!spilled() && (limitBytes == 0 || newCapacity * sizeof(T) <= limitBytes)) {
+            memory.resize(newCapacity);
+            items = memory.data();
+        }
+        else if (file.resize(newCapacity * sizeof(T))) {
+            if (!memory.empty()) {
+                std::memcpy(file.get(), memory.data(), count * sizeof(T));
+                std::vector<T>().swap(memory);
+            }
+            items = static_cast<T*>(file.get());
+        }
+        else if (!spilled()) {
+            // No room for a temporary file, keep going in memory rather than failing the scan
+            memory.resize(newCapacity);
+            items = memory.data();
+        }
+        else {
+            throw std::bad_alloc();
+        }
+        capacity = newCapacity;
+    }
+
+    const size_t limitBytes;
+    std::vector<T> memory;
+    MappedFile file;
+    T* items = nullptr;
+    size_t count = 0, capacity = 0;
+};
+
+using PathChar = std::filesystem::path::value_type;
+
+// Every file found by countFiles, stored as null-terminated native strings in one character arena so the table can
+// spill with the rest instead of holding a node and a heap string per file
+class PathTable {
+public:
+    explicit PathTable(const size_t limitBytes) : characters(limitBytes - limitBytes / 8), offsets(limitBytes / 8) {}
+
+    void add(const std::filesystem::path& path) {
+        offsets.push_back(characters.size());
+        for (const PathChar c : path.native()) {
+            characters.push_back(c);
+        }
+        characters.push_back(0);
+    }
+
+    // Sorts the table into the order a std::set of the same paths iterates in. Separators sort below every other
+    // character, which orders paths element by element like std::filesystem::path::compare without building any paths
+    void sort() {
+        std::sort(offsets.begin(), offsets.end(), [this](const uint64_t a, const uint64_t b) {
+            const PathChar* left = &characters[a];
+            const PathChar* right = &characters[b];
+            for (; *left != 0 && *left == *right; ++left, ++right) {}
+            return sortKey(*left) < sortKey(*right);
+        });
+    }
+
+    const PathChar* c_str(const size_t i) const {
+        return &characters[offsets[i]];
+    }
+    std::filesystem::path operator[](const size_t i) const {
+        return std::filesystem::path(c_str(i));
+    }
+    size_t size() const {
+        return offsets.size();
+    }
+    bool spilled() const {
+        return characters.spilled() || offsets.spilled();
+    }
+
+private:
+    static uint32_t sortKey(const PathChar c) {
+        if (c == 0) {
+            return 0;
+        }
+        if (c == '/' || c == std::filesystem::path::preferred_separator) {
+            return 1;
+        }
+        return (uint32_t)c + 2;
+    }
+
+    SpillVector<PathChar> characters;
+    SpillVector<uint64_t> offsets;
+};
+
+// Smallest side (in pixels) a reduced-resolution fingerprint decode is allowed to shrink to
+const int minThumbnailSide = 64;
+
+// Per-file data gathered once before the pair scan. Trivially copyable so the file table can spill to disk
+struct ImageFingerprint {
+    // Full-resolution dimensions, used to bucket files since verifyPair scores differently sized images as 0
+    int32_t width = 0, height = 0;
+    // 64-bit difference hash of a reduced-resolution grayscale decode, only computed when a hash index finds candidates
+    uint64_t hash = 0;
+    // Dihedral transform (see orientImage) to the canonical orientation the dimensions describe, 0 unless --dihedral
+    uint8_t orientation = 0;
+};
+
+uint32_t readBigEndian(const unsigned char* bytes, const int count) {
+    uint32_t value = 0;
+    for (int i = 0; i < count; ++i) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+uint32_t readLittleEndian(const unsigned char* bytes, const int count) {
+    uint32_t value = 0;
+    for (int i = count - 1; i >= 0; --i) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+// Container whose header readHeaderDimensions read the dimensions from
+enum class HeaderFormat { Png, Bmp, Jpeg };
+
+// Reads full-resolution dimensions from the JPEG SOF, PNG IHDR or BMP info header without decoding any pixels, and
+// which of them it was into format when given
+std::optional<cv::Size> readHeaderDimensions(const std::filesystem::path& path, HeaderFormat* format = nullptr) {
+    std::ifstream file(path, std::ios::binary);
+    unsigned char header[26];
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+        return std::nullopt;
+    }
+
+    HeaderFormat ignored;
+    HeaderFormat& found = format != nullptr ? *format : ignored;
+    if (header[0] == 0x89 && header[1] == 'P' && header[2] == 'N' && header[3] == 'G') {
+        found = HeaderFormat::Png;
+        return cv::Size(readBigEndian(header + 16, 4), readBigEndian(header + 20, 4));
+    }
+    if (header[0] == 'B' && header[1] == 'M') {
+        found = HeaderFormat::Bmp;
+        // The DIB header's size says which layout follows: BITMAPCOREHEADER (12 bytes) stores 16-bit unsigned dimensions,
+        // the later Windows and OS/2 2.x headers 32-bit signed ones (a negative height is a top-down bitmap). Anything
+        // else goes through the decode path
+        const uint32_t dibSize = readLittleEndian(header + 14, 4);
+        if (dibSize == 12) {
+            return cv::Size(readLittleEndian(header + 18, 2), readLittleEndian(header + 20, 2));
+        }
+        if (dibSize < 16 || dibSize > 124) {
+            return std::nullopt;
+        }
+        const int32_t width = (int32_t)readLittleEndian(header + 18, 4), height = (int32_t)readLittleEndian(header + 22, 4);
+        return cv::Size(width, std::abs(height));
+    }
+    if (header[0] != 0xFF || header[1] != 0xD8) {
+        return std::nullopt;
+    }
+    found = HeaderFormat::Jpeg;
+
+    // Walk JPEG markers until the first start-of-frame segment
+    file.seekg(2);
+    unsigned char marker[4];
+    while (file.read(reinterpret_cast<char*>(marker), 2)) {
+        if (marker[0] != 0xFF) {
+            return std::nullopt;
+        }
+        if (marker[1] == 0xFF) {
+            // Fill byte, the marker code is the next byte
+            file.seekg(-1, std::ios::cur);
+            continue;
+        }
+        if (marker[1] == 0x01 || (marker[1] >= 0xD0 && marker[1] <= 0xD7)) {
+            continue;
+        }
+        if (!file.read(reinterpret_cast<char*>(marker + 2), 2)) {
+            return std::nullopt;
+        }
+        const uint32_t length = readBigEndian(marker + 2, 2);
+        const bool isStartOfFrame = marker[1] >= 0xC0 && marker[1] <= 0xCF && marker[1] != 0xC4 && marker[1] != 0xC8 && marker[1] != 0xCC;
+        if (isStartOfFrame) {
+            unsigned char frame[5];
+            if (!file.read(reinterpret_cast<char*>(frame), sizeof(frame))) {
+                return std::nullopt;
+            }
+            return cv::Size(readBigEndian(frame + 3, 2), readBigEndian(frame + 1, 2));
+        }
+        if (length < 2) {
+            return std::nullopt;
+        }
+        file.seekg(length - 2, std::ios::cur);
+    }
+    return std::nullopt;
+}
+
+// Largest reduction (1/2, 1/4 or 1/8) that keeps the short side of the decode at or above minSide
+int reductionFactor(const cv::Size& size, const int minSide = minThumbnailSide) {
+    const int shortSide = std::min(size.width, size.height);
+    for (int factor = 8; factor > 1; factor /= 2) {
+        if (shortSide >= factor * minSide) {
+            return factor;
+        }
+    }
+    return 1;
+}
+
+// Orientation is ignored so thumbnails line up with the IMREAD_UNCHANGED decode verifyPair does
+int reducedGrayscaleFlag(const int factor) {
+    switch (factor) {
+        case 8: return cv::IMREAD_REDUCED_GRAYSCALE_8 | cv::IMREAD_IGNORE_ORIENTATION;
+        case 4: return cv::IMREAD_REDUCED_GRAYSCALE_4 | cv::IMREAD_IGNORE_ORIENTATION;
+        case 2: return cv::IMREAD_REDUCED_GRAYSCALE_2 | cv::IMREAD_IGNORE_ORIENTATION;
+        default: return cv::IMREAD_GRAYSCALE | cv::IMREAD_IGNORE_ORIENTATION;
+    }
+}
+
+// dHash: the thumbnail is shrunk to 9x8 and every bit says whether a pixel is darker than its right neighbour, which
+// survives recompression and small edits while unrelated images land about 32 bits apart
+uint64_t differenceHash(const cv::Mat& thumbnail) {
+    cv::Mat small;
+    cv::resize(thumbnail, small, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+    uint64_t hash = 0;
+    for (int y = 0; y < 8; ++y) {
+        const uchar* row = small.ptr<uchar>(y);
+        for (int x = 0; x < 8; ++x) {
+            hash = (hash << 1) | (row[x] < row[x + 1]);
+        }
+    }
+    return hash;
+}
+
+// Side of the grayscale thumbnail cosine similarity is computed on
+const int thumbnailVectorSide = 16;
+
+// Mean-removed, unit-length 16x16 thumbnail, so the dot product of two vectors is their cosine similarity. Kept apart
+// from ImageFingerprint since only the cosine candidate mode needs the kilobyte per file
+struct ThumbnailVector {
+    float values[thumbnailVectorSide * thumbnailVectorSide];
+};
+
+// Side of the grayscale thumbnail every image is shrunk to in scale-normalized mode, whatever its size or aspect ratio
+const int normalizedSide = 32;
+// Largest difference between two normalized thumbnail pixels that still counts as equal, enough to absorb resampling
+const int normalizedPixelTolerance = 8;
+
+struct NormalizedThumbnail {
+    uint8_t pixels[normalizedSide * normalizedSide];
+};
+
+// Flat thumbnails have nothing left after the mean is removed and stay all zero
+void fillThumbnailVector(const cv::Mat& thumbnail, ThumbnailVector& vector) {
+    cv::Mat small;
+    cv::resize(thumbnail, small, cv::Size(thumbnailVectorSide, thumbnailVectorSide), 0, 0, cv::INTER_AREA);
+    cv::Mat values(thumbnailVectorSide, thumbnailVectorSide, CV_32F, vector.values);
+    small.convertTo(values, CV_32F);
+    values -= cv::mean(values);
+    const double norm = cv::norm(values, cv::NORM_L2);
+    if (norm > 1e-6) {
+        values /= norm;
+    }
+    else {
+        values = 0;
+    }
+}
+
+// The 8 symmetries of a rectangle: 4-7 mirror left to right first, then (orientation % 4) quarter turns clockwise
+void orientImage(const cv::Mat& image, cv::Mat& oriented, const int orientation) {
+    cv::Mat mirrored;
+    if (orientation >= 4) {
+        cv::flip(image, mirrored, 1);
+    }
+    const cv::Mat& source = orientation >= 4 ? mirrored : image;
+    switch (orientation % 4) {
+        case 1: cv::rotate(source, oriented, cv::ROTATE_90_CLOCKWISE); break;
+        case 2: cv::rotate(source, oriented, cv::ROTATE_180); break;
+        case 3: cv::rotate(source, oriented, cv::ROTATE_90_COUNTERCLOCKWISE); break;
+        default: source.copyTo(oriented); break;
+    }
+}
+
+// First (centroid) and second (mxx - myy, mxy) brightness moments about the centre, with offsets doubled to stay integral
+struct OrientationMoments {
+    int64_t x = 0, y = 0, spread = 0, skew = 0;
+};
+
+// Side of the thumbnail the moments are taken on
+const int orientationSide = 16;
+// Smallest margin, relative to the thumbnail's contrast, at which a moment still decides the orientation
+const double orientationMargin = 0.01;
+
+OrientationMoments orientationMoments(const cv::Mat& small) {
+    OrientationMoments moments;
+    for (int y = 0; y < orientationSide; ++y) {
+        const uchar* row = small.ptr<uchar>(y);
+        const int64_t dy = 2 * y - (orientationSide - 1);
+        for (int x = 0; x < orientationSide; ++x) {
+            const int64_t dx = 2 * x - (orientationSide - 1);
+            moments.x += dx * row[x];
+            moments.y += dy * row[x];
+            moments.spread += (dx * dx - dy * dy) * row[x];
+            moments.skew += dx * dy * row[x];
+        }
+    }
+    return moments;
+}
+
+// Canonical orientation of a thumbnail (by centroid, then second moments, then smallest hash) and its hash in it
+std::pair<uint64_t, int> canonicalDifferenceHash(const cv::Mat& thumbnail) {
+    cv::Mat small, hashSmall, oriented;
+    cv::resize(thumbnail, small, cv::Size(orientationSide, orientationSide), 0, 0, cv::INTER_AREA);
+    cv::resize(thumbnail, hashSmall, cv::Size(9, 9), 0, 0, cv::INTER_AREA);
+    auto hashOf = [&](const int orientation) {
+        orientImage(hashSmall, oriented, orientation);
+        uint64_t hash = 0;
+        for (int y = 0; y < 8; ++y) {
+            const uchar* row = oriented.ptr<uchar>(y);
+            for (int x = 0; x < 8; ++x) {
+                hash = (hash << 1) | (row[x] < row[x + 1]);
+            }
+        }
+        return hash;
+    };
+
+    OrientationMoments moments[8];
+    for (int orientation = 0; orientation < 8; ++orientation) {
+        orientImage(small, oriented, orientation);
+        moments[orientation] = orientationMoments(oriented);
+    }
+    const double mean = cv::mean(small)[0];
+    double contrast = 0;
+    for (int y = 0; y < orientationSide; ++y) {
+        for (int x = 0; x < orientationSide; ++x) {
+            contrast += std::abs(small.at<uchar>(y, x) - mean);
+        }
+    }
+    const double firstMargin = orientationMargin * contrast * (orientationSide - 1);
+    const double secondMargin = firstMargin * (orientationSide - 1);
+
+    int best = 0;
+    for (int orientation = 1; orientation < 8; ++orientation) {
+        const OrientationMoments& m = moments[orientation];
+        if (std::min(m.y, m.x - m.y) > std::min(moments[best].y, moments[best].x - moments[best].y)) {
+            best = orientation;
+        }
+    }
+    if (std::min(moments[best].y, moments[best].x - moments[best].y) > firstMargin) {
+        return {hashOf(best), best};
+    }
+
+    best = 0;
+    for (int orientation = 1; orientation < 8; ++orientation) {
+        const OrientationMoments& m = moments[orientation];
+        const OrientationMoments& b = moments[best];
+        if (std::make_pair(std::min(m.spread, m.skew), m.x + m.y) > std::make_pair(std::min(b.spread, b.skew), b.x + b.y)) {
+            best = orientation;
+        }
+    }
+    if (std::min(moments[best].spread, moments[best].skew) > secondMargin) {
+        return {hashOf(best), best};
+    }
+
+    std::pair<uint64_t, int> smallest(std::numeric_limits<uint64_t>::max(), 0);
+    for (int orientation = 0; orientation < 8; ++orientation) {
+        smallest = std::min(smallest, std::make_pair(hashOf(orientation), orientation));
+    }
+    return smallest;
+}
+
+#if defined(HAVE_JPEG)
+// libjpeg reports fatal errors through error_exit, which must not return, so it jumps back to the caller instead
+struct JpegErrorManager {
+    jpeg_error_mgr manager;
+    std::jmp_buf jump;
+};
+
+void jpegErrorExit(j_common_ptr info) {
+    std::longjmp(reinterpret_cast<JpegErrorManager*>(info->err)->jump, 1);
+}
+
+// Corrupt-data warnings would otherwise be printed over the progress bars
+void jpegSilentMessage(j_common_ptr, int) {}
+#endif
+
+// 1/8-scale grayscale thumbnail of a progressive JPEG from its DC scan alone, false if that doesn't apply
+bool jpegDcScanThumbnail(const std::filesystem::path& path, const int factor, cv::Mat& thumbnail) {
+#if defined(HAVE_JPEG)
+    if (factor != 8) {
+        return false;
+    }
+#if defined(WINDOWS)
+    FILE* file = _wfopen(path.c_str(), L"rb");
+#else
+    FILE* file = std::fopen(path.c_str(), "rb");
+#endif
+    if (file == nullptr) {
+        return false;
+    }
+
+    jpeg_decompress_struct info;
+    JpegErrorManager errors;
+    info.err = jpeg_std_error(&errors.manager);
+    errors.manager.error_exit = jpegErrorExit;
+    errors.manager.emit_message = jpegSilentMessage;
+    jpeg_create_decompress(&info);
+    if (setjmp(errors.jump)) {
+        jpeg_destroy_decompress(&info);
+        std::fclose(file);
+        return false;
+    }
+    jpeg_stdio_src(&info, file);
+    jpeg_read_header(&info, TRUE);
+    bool usable = info.progressive_mode && (info.jpeg_color_space == JCS_YCbCr || info.jpeg_color_space == JCS_GRAYSCALE);
+    if (usable) {
+        info.out_color_space = JCS_GRAYSCALE;
+        info.scale_num = 1;
+        info.scale_denom = 8;
+        info.buffered_image = TRUE;
+        // Smoothing would shift the block means
+        info.do_block_smoothing = FALSE;
+        // Reads up to the first scan's header
+        jpeg_start_decompress(&info);
+        bool lumaInScan = false;
+        for (int c = 0; c < info.comps_in_scan; ++c) {
+            lumaInScan |= info.cur_comp_info[c]->component_index == 0;
+        }
+        usable = info.Ss == 0 && lumaInScan;
+    }
+    if (usable) {
+        thumbnail.create((int)info.output_height, (int)info.output_width, CV_8U);
+        jpeg_start_output(&info, 1);
+        while (info.output_scanline < info.output_height) {
+            JSAMPROW row = thumbnail.ptr<uchar>((int)info.output_scanline);
+            jpeg_read_scanlines(&info, &row, 1);
+        }
+    }
+    jpeg_destroy_decompress(&info);
+    std::fclose(file);
+    return usable;
+#else
+    return false;
+#endif
+}
+
+// Returns NULL optional if the image can't be read. JPEG, PNG and BMP only need their header for dimensions, everything
+// else falls back to a single grayscale decode. With dihedral the image's canonical orientation is picked from its
+// thumbnail and the hash and thumbnail vector describe it in that orientation
+std::optional<ImageFingerprint> fingerprintImage(const std::filesystem::path& path, const bool withHash, const bool dihedral, ThumbnailVector* vector = nullptr, NormalizedThumbnail* normalized = nullptr) {
+    ImageFingerprint fingerprint;
+    cv::Mat thumbnail;
+    HeaderFormat format;
+    const auto headerSize = readHeaderDimensions(path, &format);
+    if (headerSize && headerSize->width > 0 && headerSize->height > 0) {
+        fingerprint.width = headerSize->width;
+        fingerprint.height = headerSize->height;
+        if (!withHash && !dihedral && vector == nullptr && normalized == nullptr) {
+            return fingerprint;
+        }
+        const int factor = reductionFactor(*headerSize);
+        if (format != HeaderFormat::Jpeg || !jpegDcScanThumbnail(path, factor, thumbnail)) {
+            thumbnail = cv::imread(path.string(), reducedGrayscaleFlag(factor));
+        }
+    }
+    else {
+        thumbnail = cv::imread(path.string(), reducedGrayscaleFlag(1));
+        fingerprint.width = thumbnail.cols;
+        fingerprint.height = thumbnail.rows;
+    }
+
+    if (thumbnail.data == nullptr) {
+        return std::nullopt;
+    }
+    if (dihedral) {
+        const auto [hash, orientation] = canonicalDifferenceHash(thumbnail);
+        fingerprint.hash = withHash ? hash : 0;
+        fingerprint.orientation = (uint8_t)orientation;
+        if (orientation % 2 == 1) {
+            std::swap(fingerprint.width, fingerprint.height);
+        }
+        if ((vector != nullptr || normalized != nullptr) && orientation != 0) {
+            cv::Mat oriented;
+            orientImage(thumbnail, oriented, orientation);
+            thumbnail = oriented;
+        }
+    }
+    else if (withHash) {
+        fingerprint.hash = differenceHash(thumbnail);
+    }
+    if (vector != nullptr) {
+        fillThumbnailVector(thumbnail, *vector);
+    }
+    if (normalized != nullptr) {
+        cv::Mat pixels(normalizedSide, normalizedSide, CV_8U, normalized->pixels);
+        cv::resize(thumbnail, pixels, pixels.size(), 0, 0, cv::INTER_AREA);
+    }
+    return fingerprint;
+}
+
+// Grid sizes (blocks per side) of the coarse levels checked before a full-resolution comparison, coarsest first
+const std::vector<int> pyramidLevels = {16, 64};
+// Tiles per side for the per-tile histograms
+const int histogramTiles = 4;
+// z-score of the confidence interval used by the sampling estimator (99.9% two-sided)
+const double estimateZ = 3.29;
+// Side length in pixels of the hashed tiles used to skip identical regions during verification
+const int hashTileSize = 64;
+
+// Disjoint shares of --memory-budget for every structure that grows with the files or matches (0 is unbounded)
+struct MemoryBudget {
+    // Per-file tables, including the embedding mode's readable flags and the --container-hash hashes
+    size_t paths = 0, fingerprints = 0, vectors = 0, representatives = 0, groups = 0, embeddingFlags = 0, containerHashes = 0;
+    // What the ORB, embedding and scale-normalized modes keep per file instead of signatures
+    size_t features = 0;
+    // The size-sorted candidate list, then each bucket's hashes or vectors, index and candidate pairs
+    size_t candidates = 0, bucketKeys = 0, candidateIndex = 0, bucketPairs = 0;
+    size_t matches = 0, signatures = 0, imageCache = 0;
+};
+
+MemoryBudget splitMemoryBudget(const size_t totalBytes) {
+    MemoryBudget budget;
+    const size_t fileTable = totalBytes / 10 * 3;
+    budget.paths = fileTable / 4;
+    budget.fingerprints = fileTable / 8;
+    budget.vectors = fileTable / 16 * 5;
+    budget.representatives = fileTable / 16;
+    budget.groups = fileTable / 16;
+    budget.embeddingFlags = fileTable / 16;
+    budget.containerHashes = fileTable / 8;
+    budget.features = totalBytes / 10;
+    const size_t candidates = totalBytes / 10;
+    budget.candidates = candidates / 4;
+    budget.bucketKeys = candidates / 4;
+    budget.candidateIndex = candidates / 4;
+    budget.bucketPairs = candidates / 4;
+    budget.matches = totalBytes / 10;
+    budget.signatures = totalBytes / 20 * 3;
+    budget.imageCache = totalBytes / 4;
+    return budget;
+}
+
+// Matched pair of file table indices, recorded during the scan and grouped once it's done
+struct MatchEdge {
+    uint32_t file1, file2;
+};
+
+// How candidate pairs are found within a size bucket
+enum class CandidateMode {
+    // Every pair, exact
+    Exhaustive,
+    // Pairs whose hashes are within hashRadius bits, found with a BK-tree per bucket
+    BkTree,
+    // The same pairs found with multi-index hashing, which holds up better than a BK-tree for millions of hashes
+    MultiIndex,
+    // The same pairs found by checking every hash pair with a tiled, multi-threaded scan
+    HammingScan,
+    // Pairs whose 16x16 thumbnails have a cosine similarity of at least cosineThreshold, computed with blocked matrix
+    // multiplies
+    Cosine,
+    // The same pairs approximately, from each file's nearest neighbours in an HNSW graph
+    Hnsw
+};
+
+bool usesVectors(const CandidateMode mode) {
+    return mode == CandidateMode::Cosine || mode == CandidateMode::Hnsw;
+}
+
+bool usesHashes(const CandidateMode mode) {
+    return mode == CandidateMode::BkTree || mode == CandidateMode::MultiIndex || mode == CandidateMode::HammingScan;
+}
+
+const char* candidateModeName(const CandidateMode mode) {
+    switch (mode) {
+        case CandidateMode::BkTree: return "bktree";
+        case CandidateMode::MultiIndex: return "mih";
+        case CandidateMode::HammingScan: return "scan";
+        case CandidateMode::Cosine: return "cosine";
+        case CandidateMode::Hnsw: return "hnsw";
+        default: return "exhaustive";
+    }
+}
+
+// Learned embedding mode: a CNN run through cv::dnn replaces the pixel comparison, so crops, resizes and
+// recompressions can match
+struct EmbeddingOptions {
+    // Network file cv::dnn::readNet understands (ONNX, Caffe, TensorFlow...), empty disables the mode
+    std::string model;
+    // Side of the square network input, images per forward pass, and whether the network is quantized to int8
+    int inputSize = 224, batch = 32;
+    bool int8 = false;
+    // Smallest cosine similarity between embeddings that makes two files duplicates
+    double threshold = 0.9;
+};
+
+// Geometric verification mode: ORB keypoints per file, candidate pairs from descriptor votes through an LSH index and
+// a RANSAC homography to confirm them, so crops and rotations match across sizes
+struct OrbOptions {
+    bool enabled = false;
+    // Keypoints per file, descriptor votes that make a candidate pair and RANSAC inliers that confirm one
+    int features = 500, minVotes = 12, minInliers = 15;
+};
+
+// Graph degree and search breadths of the HNSW index: m links per node (2m on the bottom level), efConstruction
+// candidates considered while linking a node and efSearch while querying
+struct HnswParameters {
+    int m = 16, efConstruction = 200, efSearch = 64;
+};
+
+struct ScanOptions {
+    double threshold = 0.9;
+    MemoryBudget budget;
+    CandidateMode candidates = CandidateMode::Exhaustive;
+    int hashRadius = 6;
+    double cosineThreshold = 0.95;
+    HnswParameters hnsw;
+    EmbeddingOptions embedding;
+    OrbOptions orb;
+    // Turn every image to a canonical orientation first, so rotated and mirrored copies bucket, hash and compare alike
+    bool dihedral = false;
+    // Compare normalized thumbnails of files whose aspect ratios are within aspectTolerance (relative) of each other
+    // instead of full-resolution pixels of files with equal dimensions
+    bool scaleNormalized = false;
+    double aspectTolerance = 0.01;
+    // File the HNSW graphs are loaded from and saved to, empty keeps them in memory only
+    std::string hnswIndexPath;
+    bool pyramid = false;
+    // Pairs whose coarse bound is below threshold + pyramidMargin are rejected, 0 keeps every rejection provable
+    double pyramidMargin = 0;
+    // Decide pairs from a sample of elements, falling back to a full scan when the interval straddles the threshold
+    bool estimate = false;
+    size_t estimateSamples = 4096;
+    // Samples whose values differ by at most pixelTolerance 8-bit levels count as equal (scaled by 257 for 16-bit
+    // images), and errorMetrics reports the mean absolute error and PSNR of matched pairs from the same pass
+    int pixelTolerance = 0;
+    bool errorMetrics = false;
+    // Score verified pairs by mean SSIM instead of the fraction of equal samples
+    bool ssim = false;
+    // Pixels that are fully transparent in both images count as equal whatever colour they hold
+    bool ignoreTransparent = false;
+    // Same-size images of different 8/16-bit layouts are compared as 8-bit gray/BGR plus alpha instead of scoring 0
+    bool normalizeFormats = false;
+    // Group JPEGs and PNGs whose pixel data is byte-identical from a hash of it before anything is decoded
+    bool containerHash = false;
+    // Byte budget of the decoded image cache (0 disables it) and whether entries are LZ4-compressed
+    size_t cacheBytes = 0;
+    bool cacheCompress = false;
+};
+
+// Whether verification counts exactly equal samples, which the histogram, pyramid and sampling shortcuts are bounds of
+bool exactEqualityMetric(const ScanOptions& options) {
+    return options.pixelTolerance == 0 && !options.ssim && !options.ignoreTransparent;
+}
+
+struct ScanStats {
+    // Pairs the candidate index handed to verification out of every same-size pair, and time spent building/querying it
+    size_t candidatePairs = 0, possiblePairs = 0;
+    double candidateSeconds = 0;
+    // The HNSW graphs couldn't be written to --hnsw-index
+    bool hnswSaveFailed = false;
+    // Files embedded, files that couldn't be read or run, workers used and wall time of the embedding stage
+    size_t embeddedImages = 0, embeddingFailures = 0, embeddingCores = 0;
+    double embeddingSeconds = 0;
+    // ORB keypoints found over every file and the time spent finding them
+    size_t orbKeypoints = 0;
+    double orbExtractSeconds = 0;
+    // Pairs whose histogram bound was already below the threshold
+    size_t histogramPruned = 0;
+    // Pairs with signatures rejected at each entry of pyramidLevels, and those that passed every level and needed the
+    // full-resolution comparison (pairs without signatures go straight to it and aren't counted)
+    std::vector<size_t> pyramidRejected = std::vector<size_t>(pyramidLevels.size(), 0);
+    size_t fullResolution = 0;
+    // Tiles credited from matching hashes vs tiles that had to be scanned during verification
+    size_t tilesMatched = 0, tilesScanned = 0;
+    // Pairs the sampling estimator decided on its own, and pairs whose interval straddled the threshold
+    size_t estimateAccepted = 0, estimateRejected = 0, estimateExact = 0;
+    // JPEGs and PNGs whose pixel data was hashed, and files matched to an earlier file from that hash alone
+    size_t containerHashed = 0, containerMatched = 0;
+    // Pairs --ssim couldn't score because ssimKernel has no kernel for their depth, scored 0 instead, and pairs
+    // errorKernel has no kernel for (scored 0 under --pixel-tolerance, compared exactly and unmeasured otherwise)
+    size_t ssimUnsupported = 0, errorUnsupported = 0;
+    // Matched pairs that were measured, the sum of their mean absolute errors (in 8-bit levels) and their lowest PSNR
+    size_t measuredPairs = 0;
+    double absoluteErrorSum = 0, lowestPsnr = std::numeric_limits<double>::infinity();
+    // Heap allocations made while decoding and while comparing verified pairs, and Mat pixel buffers created while
+    // decoding, in total and for the pairs verified after the first of each bucket (COUNT_ALLOCATIONS builds only)
+    size_t decodeAllocations = 0, compareAllocations = 0, decodeMatBuffers = 0, warmMatBuffers = 0;
+    // Decoded image cache activity, stored vs raw bytes of everything inserted and time spent decompressing hits
+    size_t cacheHits = 0, cacheMisses = 0, cacheEvictions = 0, cacheRawBytes = 0, cacheStoredBytes = 0;
+    double cacheDecompressSeconds = 0;
+    // Files in buckets whose signatures no longer fit the budget, and structures that spilled to temporary files
+    size_t signaturesSkipped = 0;
+    std::vector<std::string> spilled;
+};
+
+// Heap allocations and Mat pixel buffers made by the current thread. Only counted when built with COUNT_ALLOCATIONS,
+// which replaces the global operator new and the cv::Mat allocator as a test hook for the comparison path
+thread_local size_t threadAllocations = 0, threadMatBuffers = 0;
+
+#if defined(COUNT_ALLOCATIONS)
+void* operator new(size_t size) {
+    threadAllocations++;
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+    // Pixel buffers (cv::fastMalloc, which operator new doesn't see) are counted apart from the heap, and the UMatData
+    // header the standard allocator creates with new isn't counted at all
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+        const size_t before = threadAllocations;
+        cv::UMatData* allocated = cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        threadAllocations = before;
+        threadMatBuffers += data == nullptr ? 1 : 0;
+        return allocated;
+    }
+
+    bool allocate(cv::UMatData* data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override {
+        return cv::Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData* data) const override {
+        cv::Mat::getStdAllocator()->deallocate(data);
+    }
+};
+#endif
+
+// Adds the heap allocations and Mat buffers the current thread makes while the scope is alive to their counters
+struct AllocationScope {
+    size_t& heapCounter;
+    size_t& matCounter;
+    const size_t heapStart, matStart;
+
+    AllocationScope(size_t& heapCounter, size_t& matCounter) : heapCounter(heapCounter), matCounter(matCounter), heapStart(threadAllocations), matStart(threadMatBuffers) {}
+    ~AllocationScope() {
+        heapCounter += threadAllocations - heapStart;
+        matCounter += threadMatBuffers - matStart;
+    }
+};
+
+// Notes each structure that spilled to a temporary file, by name, for the scan summary
+void reportSpilled(ScanStats& stats, const std::initializer_list<std::pair<const char*, bool>> structures) {
+    for (const auto& [name, spilled] : structures) {
+        if (spilled) {
+            stats.spilled.push_back(name);
+        }
+    }
+}
+
+// Sums of raw bytes over a grid of blocks, 64-bit since a coarse block of a large image holds billions of bytes
+struct BlockSums {
+    int gridRows = 0, gridCols = 0;
+    std::vector<uint64_t> sums;
+};
+
+// Per-file summary of the full-resolution pixels, built once per file (not per pair) for files that share a bucket.
+// The buffer is treated as rows x (cols * elemSize) bytes exactly like verification does, so two same-sized images
+// of the same type always share the same block, tile and byte lane layout
+struct PixelSignature {
+    int type = 0;
+    size_t totalBytes = 0, totalElements = 0;
+    // Bytes per pixel and per element, byte lane l belongs to channel l / elementBytes
+    int lanes = 0, elementBytes = 0;
+    // 256-bin histograms of every byte lane (one lane per byte of a pixel), for the whole image and for each tile
+    std::vector<uint32_t> histogram;
+    std::vector<uint32_t> tileHistograms;
+    std::vector<BlockSums> pyramid;
+    // Hash of every hashTileSize x hashTileSize tile, row-major
+    int hashTileCols = 0;
+    std::vector<uint64_t> tileHashes;
+};
+
+// Fills every part of the signature in a single pass over the full-resolution pixels
+PixelSignature buildPixelSignature(const cv::Mat& image, const ScanOptions& options) {
+    PixelSignature signature;
+    signature.type = image.type();
+    signature.lanes = (int)image.elemSize();
+    const int rowBytes = image.cols * signature.lanes;
+    signature.totalBytes = (size_t)image.rows * rowBytes;
+    signature.elementBytes = (int)image.elemSize1();
+    signature.totalElements = image.total() * image.channels();
+
+    // Offset of each byte column into the histograms of its tile row
+    const int tileStride = signature.lanes * 256;
+    signature.tileHistograms.assign((size_t)histogramTiles * histogramTiles * tileStride, 0);
+    std::vector<int> histogramOffsets(rowBytes);
+    for (int x = 0; x < rowBytes; ++x) {
+        const int tileCol = (int)((int64_t)(x / signature.lanes) * histogramTiles / image.cols);
+        histogramOffsets[x] = tileCol * tileStride + (x % signature.lanes) * 256;
+    }
+
+    std::vector<std::vector<int>> columnBlocks;
+    if (options.pyramid) {
+        for (const int grid : pyramidLevels) {
+            BlockSums level;
+            level.gridRows = std::min(grid, image.rows);
+            level.gridCols = std::min(grid, rowBytes);
+            level.sums.assign((size_t)level.gridRows * level.gridCols, 0);
+            signature.pyramid.push_back(std::move(level));
+
+            std::vector<int> blocks(rowBytes);
+            for (int x = 0; x < rowBytes; ++x) {
+                blocks[x] = (int)((int64_t)x * signature.pyramid.back().gridCols / rowBytes);
+            }
+            columnBlocks.push_back(std::move(blocks));
+        }
+    }
+
+    signature.hashTileCols = (image.cols + hashTileSize - 1) / hashTileSize;
+    signature.tileHashes.assign((size_t)signature.hashTileCols * ((image.rows + hashTileSize - 1) / hashTileSize), 0);
+    const int tileBytes = hashTileSize * signature.lanes;
+    for (int y = 0; y < image.rows; ++y) {
+        const uchar* row = image.ptr<uchar>(y);
+        uint64_t* hashes = signature.tileHashes.data() + (size_t)(y / hashTileSize) * signature.hashTileCols;
+        for (int tx = 0; tx < signature.hashTileCols; ++tx) {
+            const int start = tx * tileBytes;
+            hashes[tx] = hashBytes(row + start, std::min(tileBytes, rowBytes - start), hashes[tx]);
+        }
+        uint32_t* histograms = signature.tileHistograms.data() + (size_t)((int64_t)y * histogramTiles / image.rows) * histogramTiles * tileStride;
+        for (int x = 0; x < rowBytes; ++x) {
+            histograms[histogramOffsets[x] + row[x]]++;
+        }
+        for (size_t l = 0; l < signature.pyramid.size(); ++l) {
+            auto& level = signature.pyramid[l];
+            uint64_t* sums = level.sums.data() + (size_t)((int64_t)y * level.gridRows / image.rows) * level.gridCols;
+            const int* blocks = columnBlocks[l].data();
+            for (int x = 0; x < rowBytes; ++x) {
+                sums[blocks[x]] += row[x];
+            }
+        }
+    }
+
+    signature.histogram.assign(tileStride, 0);
+    for (size_t i = 0; i < signature.tileHistograms.size(); ++i) {
+        signature.histogram[i % tileStride] += signature.tileHistograms[i];
+    }
+    return signature;
+}
+
+// Bookkeeping of one std::map node around a signature: its key, three links and colour, rounded up
+const size_t signatureNodeBytes = 4 * sizeof(void*) + sizeof(uint64_t);
+
+size_t signatureBytes(const PixelSignature& signature) {
+    size_t bytes = sizeof(PixelSignature) + (signature.histogram.size() + signature.tileHistograms.size()) * sizeof(uint32_t) + signature.tileHashes.size() * sizeof(uint64_t);
+    for (const auto& level : signature.pyramid) {
+        bytes += level.sums.size() * sizeof(uint64_t);
+    }
+    return bytes;
+}
+
+// Histogram intersection: a byte value can only be equal at as many positions as the rarer side has it, so the sum of
+// bin-wise minimums bounds the number of equal bytes in a lane. An element is only equal if every one of its bytes is,
+// so each channel is bounded by its tightest lane. Histograms are laid out as blocks of lanes * 256 bins (one block per
+// tile), which gives a tighter bound per tile since positions can't match across tiles
+uint64_t equalElementsBound(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b, const int lanes, const int elementBytes) {
+    uint64_t bound = 0;
+    for (size_t block = 0; block < a.size(); block += (size_t)lanes * 256) {
+        for (int channel = 0; channel < lanes / elementBytes; ++channel) {
+            uint64_t channelBound = UINT64_MAX;
+            for (int lane = channel * elementBytes; lane < (channel + 1) * elementBytes; ++lane) {
+                uint64_t intersection = 0;
+                for (size_t i = block + (size_t)lane * 256; i < block + (size_t)(lane + 1) * 256; ++i) {
+                    intersection += std::min(a[i], b[i]);
+                }
+                channelBound = std::min(channelBound, intersection);
+            }
+            bound += channelBound;
+        }
+    }
+    return bound;
+}
+
+// Upper bound on the equal-element fraction verifyPair would return. A block whose sums differ by d must contain at
+// least ceil(d / 255) differing bytes, since no single byte can contribute more than 255 to the difference, and each
+// differing element accounts for at most elementBytes of them
+double blockSumsUpperBound(const BlockSums& a, const BlockSums& b, const PixelSignature& signature) {
+    uint64_t differingBytes = 0;
+    for (size_t i = 0; i < a.sums.size(); ++i) {
+        const uint64_t delta = a.sums[i] > b.sums[i] ? a.sums[i] - b.sums[i] : b.sums[i] - a.sums[i];
+        differingBytes += (delta + 254) / 255;
+    }
+    const uint64_t differingElements = (differingBytes + signature.elementBytes - 1) / signature.elementBytes;
+    return 1.0 - (double)differingElements / signature.totalElements;
+}
+
+bool signaturesComparable(const PixelSignature& a, const PixelSignature& b) {
+    return a.type == b.type && a.totalBytes == b.totalBytes;
+}
+
+// True if the histograms prove the pair can't reach the threshold, checking the cheap whole-image bound first
+bool histogramRejects(const PixelSignature& a, const PixelSignature& b, const double threshold) {
+    if (!signaturesComparable(a, b)) {
+        return false;
+    }
+    return (double)equalElementsBound(a.histogram, b.histogram, a.lanes, a.elementBytes) / a.totalElements < threshold
+        || (double)equalElementsBound(a.tileHistograms, b.tileHistograms, a.lanes, a.elementBytes) / a.totalElements < threshold;
+}
+
+// Returns the index of the first pyramid level that rejected the pair, or pyramidLevels.size() if every level passed
+// and the pair has to be compared at full resolution
+size_t pyramidRejectionLevel(const PixelSignature& a, const PixelSignature& b, const ScanOptions& options) {
+    if (!signaturesComparable(a, b)) {
+        return pyramidLevels.size();
+    }
+    for (size_t l = 0; l < pyramidLevels.size(); ++l) {
+        if (blockSumsUpperBound(a.pyramid[l], b.pyramid[l], a) < options.threshold + options.pyramidMargin) {
+            return l;
+        }
+    }
+    return pyramidLevels.size();
+}
+
+// Same count as countEqualElements, but tiles whose hashes match are credited with all of their elements without being
+// read (a 64-bit hash collision on a differing tile is the only way this can disagree with a full scan)
+size_t countEqualElementsTiled(const cv::Mat& image1Mat, const cv::Mat& image2Mat, const EqualElementsKernel kernel, const PixelSignature& signature1, const PixelSignature& signature2, ScanStats& stats) {
+    const int channels = image1Mat.channels();
+    const int lanes = signature1.lanes;
+    size_t equal = 0;
+    for (size_t tile = 0; tile < signature1.tileHashes.size(); ++tile) {
+        const int top = (int)(tile / signature1.hashTileCols) * hashTileSize, bottom = std::min(top + hashTileSize, image1Mat.rows);
+        const int left = (int)(tile % signature1.hashTileCols) * hashTileSize, width = std::min(hashTileSize, image1Mat.cols - left);
+        if (signature1.tileHashes[tile] == signature2.tileHashes[tile]) {
+            equal += (size_t)(bottom - top) * width * channels;
+            stats.tilesMatched++;
+            continue;
+        }
+        for (int y = top; y < bottom; ++y) {
+            equal += kernel(image1Mat.ptr<uchar>(y) + (size_t)left * lanes, image2Mat.ptr<uchar>(y) + (size_t)left * lanes, width);
+        }
+        stats.tilesScanned++;
+    }
+    return equal;
+}
+
+struct SimilarityEstimate {
+    double low = 0, high = 1;
+};
+
+// Wilson score interval for the equal-element fraction from one random element in each of `samples` equally sized
+// strata. Stratifying keeps the sample spread over the whole image so a small differing region can't be missed entirely
+SimilarityEstimate estimateSimilarity(const cv::Mat& image1Mat, const cv::Mat& image2Mat, const size_t samples) {
+    const size_t elementBytes = image1Mat.elemSize1();
+    const size_t rowElements = (size_t)image1Mat.cols * image1Mat.channels();
+    const size_t totalElements = rowElements * image1Mat.rows;
+    const double stratum = (double)totalElements / samples;
+    // Fixed seed so repeated scans of the same files make the same decisions
+    uint64_t state = 0x853C49E6748FEA9Bull;
+    size_t equal = 0;
+    for (size_t s = 0; s < samples; ++s) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        const size_t position = std::min(totalElements - 1, (size_t)((s + (state >> 11) * 0x1.0p-53) * stratum));
+        const size_t offset = (position % rowElements) * elementBytes;
+        const int y = (int)(position / rowElements);
+        equal += std::memcmp(image1Mat.ptr<uchar>(y) + offset, image2Mat.ptr<uchar>(y) + offset, elementBytes) == 0;
+    }
+
+    const double n = (double)samples, p = equal / n, z2 = estimateZ * estimateZ;
+    const double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+    const double spread = estimateZ * std::sqrt(p * (1 - p) / n + z2 / (4 * n * n)) / (1 + z2 / n);
+    return {center - spread, center + spread};
+}
+
+// Reusable per-worker storage for verification. Files are read into buffers that only grow and decoded into Mats that
+// OpenCV reuses while consecutive images share a size and type, so once warmed up on a bucket the comparison itself
+// makes no heap allocations (the codecs behind cv::imdecode still allocate their own decoder state)
+struct ComparisonScratch {
+    std::vector<uchar> file1, file2;
+    cv::Mat image1, image2;
+    // Swapped with an image turned to its canonical orientation, so --dihedral reuses buffers too
+    cv::Mat oriented;
+    // Mean absolute error (in 8-bit levels) and PSNR of the last pair verifyPair measured, measured is false when the
+    // pair was decided without the error kernel
+    bool measured = false;
+    double meanAbsoluteError = 0, psnr = 0;
+    // Reserved for the widest strip (four channels) so the first SSIM comparison doesn't allocate either
+    SsimScratch ssim;
+
+    ComparisonScratch() {
+        const size_t sums = 5 * ((size_t)(ssimStripWindows + ssimWindow - 1) * 4 + (size_t)ssimStripWindows * 4);
+        ssim.narrowSums.reserve(sums);
+        ssim.wideSums.reserve(sums);
+        ssim.moments.reserve(5 * (size_t)ssimStripWindows * 4);
+    }
+};
+
+// Reads a whole file into a reused buffer. The stream is given a stack buffer so opening it doesn't allocate either
+bool readFileInto(const PathChar* path, std::vector<uchar>& buffer) {
+    char streamBuffer[256];
+    std::ifstream file;
+    file.rdbuf()->pubsetbuf(streamBuffer, sizeof(streamBuffer));
+    file.open(path, std::ios::binary);
+    if (!file.seekg(0, std::ios::end)) {
+        return false;
+    }
+    const std::streamoff size = file.tellg();
+    file.seekg(0);
+    buffer.resize(size);
+    return size > 0 && file.read(reinterpret_cast<char*>(buffer.data()), size);
+}
+
+// Formats whose OpenCV decoders can't read from memory (OpenEXR, Radiance HDR and JPEG 2000 through Jasper): imdecode
+// would write the buffer back out to a temporary file and decode that
+bool decodesFromFileOnly(const PathChar* path) {
+    const std::string extension = std::filesystem::path(path).extension().string();
+    for (const char* fileOnly : {".exr", ".hdr", ".pic", ".jp2", ".j2k", ".jpf", ".jpx", ".jpc"}) {
+        if (strcasecmp(extension.c_str(), fileOnly) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Same decode as cv::imread(path, cv::IMREAD_UNCHANGED), but into preallocated storage. Formats that can only be
+// decoded from a file go through cv::imread itself and get a fresh Mat
+bool decodeInto(const PathChar* path, std::vector<uchar>& buffer, cv::Mat& image) {
+    if (decodesFromFileOnly(path)) {
+        image = cv::imread(std::filesystem::path(path).string(), cv::IMREAD_UNCHANGED);
+        return image.data != nullptr;
+    }
+    if (!readFileInto(path, buffer)) {
+        return false;
+    }
+    // imdecode leaves the placeholder untouched on failure, so the returned header is what says whether it worked
+    return cv::imdecode(buffer, cv::IMREAD_UNCHANGED, &image).data != nullptr;
+}
+
+// Hash of the JPEG segments that decide the pixels (tables, headers and scan data), 0 if the markers don't parse
+uint64_t jpegScanHash(const std::vector<uchar>& data) {
+    const size_t size = data.size();
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return 0;
+    }
+    uint64_t result = 0;
+    bool sawScan = false;
+    size_t position = 2;
+    while (position + 1 < size) {
+        if (data[position] != 0xFF) {
+            return 0;
+        }
+        const uchar marker = data[position + 1];
+        // Fill bytes before a marker, and standalone markers without a length
+        if (marker == 0xFF) {
+            position++;
+            continue;
+        }
+        if (marker == 0xD9) {
+            break;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            position += 2;
+            continue;
+        }
+        if (position + 4 > size) {
+            return 0;
+        }
+        size_t end = position + 2 + ((size_t)data[position + 2] << 8 | data[position + 3]);
+        if (end > size) {
+            return 0;
+        }
+        // Entropy-coded data runs until the next marker that isn't a stuffed 0xFF00 or a restart marker
+        if (marker == 0xDA) {
+            sawScan = true;
+            while (end + 1 < size) {
+                const uchar* next = static_cast<const uchar*>(std::memchr(&data[end], 0xFF, size - end - 1));
+                if (next == nullptr) {
+                    end = size;
+                    break;
+                }
+                end = next - data.data();
+                const uchar following = data[end + 1];
+                if (following != 0x00 && !(following >= 0xD0 && following <= 0xD7)) {
+                    break;
+                }
+                end += 2;
+            }
+            end = std::min(end, size);
+        }
+        const bool metadata = (marker >= 0xE0 && marker <= 0xEF && marker != 0xEE) || marker == 0xFE;
+        if (!metadata) {
+            result = hashBytes(&data[position], end - position, result);
+        }
+        position = end;
+    }
+    return sawScan ? result : 0;
+}
+
+// Hash of a PNG's header, palette, transparency and image data chunks. Text, EXIF, time and every other ancillary
+// chunk is skipped. 0 if the chunks don't parse
+uint64_t pngDataHash(const std::vector<uchar>& data) {
+    static const uchar signature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+    const size_t size = data.size();
+    if (size < 8 || std::memcmp(data.data(), signature, 8) != 0) {
+        return 0;
+    }
+    uint64_t result = 0;
+    bool sawData = false;
+    for (size_t position = 8; position + 12 <= size;) {
+        const size_t length = (size_t)data[position] << 24 | (size_t)data[position + 1] << 16 | (size_t)data[position + 2] << 8 | data[position + 3];
+        const size_t end = position + 12 + length;
+        if (end > size) {
+            return 0;
+        }
+        const char* type = reinterpret_cast<const char*>(&data[position + 4]);
+        if (std::memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+        const bool isData = std::memcmp(type, "IDAT", 4) == 0;
+        sawData |= isData;
+        if (isData || std::memcmp(type, "IHDR", 4) == 0 || std::memcmp(type, "PLTE", 4) == 0 || std::memcmp(type, "tRNS", 4) == 0) {
+            // Type and payload, the CRC adds nothing
+            result = hashBytes(&data[position + 4], 4 + length, result);
+        }
+        position = end;
+    }
+    return sawData ? result : 0;
+}
+
+// Hash that's equal for JPEGs or PNGs whose pixel data is byte-for-byte identical however their metadata differs, so
+// such copies can be grouped without decoding. 0 for other formats and for files that can't be read or parsed
+uint64_t containerHash(const PathChar* path, std::vector<uchar>& buffer) {
+    if (!readFileInto(path, buffer)) {
+        return 0;
+    }
+    if (const uint64_t jpeg = jpegScanHash(buffer)) {
+        return jpeg;
+    }
+    return pngDataHash(buffer);
+}
+
+// A file and its container hash, sorted so files with identical pixel data end up next to each other
+struct ContainerEntry {
+    uint64_t hash;
+    uint32_t file;
+};
+
+// Groups JPEGs and PNGs by containerHash, pointing each file at its group's first file and matching the two
+void findContainerDuplicates(const PathTable& paths, const MemoryBudget& budget, SpillVector<uint32_t>& representatives, SpillVector<MatchEdge>& matches, ScanStats& stats, const std::function<void(size_t)>& progress) {
+    SpillVector<ContainerEntry> entries(budget.containerHashes);
+    std::vector<uchar> buffer;
+    for (size_t file = 0; file < paths.size(); ++file) {
+        progress(file);
+        representatives.push_back((uint32_t)file);
+        if (const uint64_t hash = containerHash(paths.c_str(file), buffer)) {
+            entries.push_back({hash, (uint32_t)file});
+        }
+    }
+    stats.containerHashed = entries.size();
+    reportSpilled(stats, {{"container hashes", entries.spilled()}});
+
+    std::sort(entries.begin(), entries.end(), [](const ContainerEntry& a, const ContainerEntry& b) {
+        return a.hash != b.hash ? a.hash < b.hash : a.file < b.file;
+    });
+    for (size_t start = 0, end = 0; start < entries.size(); start = end) {
+        for (end = start + 1; end < entries.size() && entries[end].hash == entries[start].hash; ++end) {
+            representatives[entries[end].file] = entries[start].file;
+            matches.push_back({entries[start].file, entries[end].file});
+            stats.containerMatched++;
+        }
+    }
+}
+
+// Decoded images kept between the pairs of a bucket within a byte budget (LRU), optionally LZ4-compressed
+class DecodedImageCache {
+public:
+    DecodedImageCache(const size_t budgetBytes, const bool compress) : budgetBytes(budgetBytes), compress(compress) {}
+
+    bool enabled() const {
+        return budgetBytes > 0;
+    }
+
+    // Fills image on a hit, on a miss (entries that fail to decompress are evicted) the caller decodes into it
+    bool lookup(const size_t file, cv::Mat& image, ScanStats& stats) {
+        const auto entry = entries.find(file);
+        if (entry == entries.end()) {
+            stats.cacheMisses++;
+            return false;
+        }
+
+        Entry& cached = entry->second;
+        image.create(cached.rows, cached.cols, cached.type);
+        if (!cached.compressed) {
+            std::memcpy(image.data, cached.bytes.data(), cached.bytes.size());
+        }
+        else {
+#if defined(HAVE_LZ4)
+            const auto start = std::chrono::steady_clock::now();
+            const size_t rawBytes = image.total() * image.elemSize();
+            const int decompressed = LZ4_decompress_safe(reinterpret_cast<const char*>(cached.bytes.data()), reinterpret_cast<char*>(image.data), (int)cached.bytes.size(), (int)rawBytes);
+            stats.cacheDecompressSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (decompressed < 0 || (size_t)decompressed != rawBytes) {
+                evict(entry);
+                stats.cacheMisses++;
+                return false;
+            }
+#endif
+        }
+        stats.cacheHits++;
+        recency.splice(recency.begin(), recency, cached.recency);
+        return true;
+    }
+
+    void insert(const size_t file, const cv::Mat& image, ScanStats& stats) {
+        const size_t rawBytes = image.total() * image.elemSize();
+        if (!image.isContinuous() || rawBytes > budgetBytes || entries.count(file) > 0) {
+            return;
+        }
+
+        Entry entry;
+        entry.rows = image.rows;
+        entry.cols = image.cols;
+        entry.type = image.type();
+#if defined(HAVE_LZ4)
+        if (compress && rawBytes <= LZ4_MAX_INPUT_SIZE) {
+            entry.bytes.resize(LZ4_compressBound((int)rawBytes));
+            const int compressedBytes = LZ4_compress_default(reinterpret_cast<const char*>(image.data), reinterpret_cast<char*>(entry.bytes.data()), (int)rawBytes, (int)entry.bytes.size());
+            entry.compressed = compressedBytes > 0 && (size_t)compressedBytes < rawBytes;
+            entry.bytes.resize(entry.compressed ? compressedBytes : 0);
+            entry.bytes.shrink_to_fit();
+        }
+#endif
+        if (!entry.compressed) {
+            entry.bytes.assign(image.data, image.data + rawBytes);
+        }
+
+        while (usedBytes + entry.bytes.size() > budgetBytes && !recency.empty()) {
+            evict(entries.find(recency.back()));
+            stats.cacheEvictions++;
+        }
+        usedBytes += entry.bytes.size();
+        stats.cacheRawBytes += rawBytes;
+        stats.cacheStoredBytes += entry.bytes.size();
+        recency.push_front(file);
+        entry.recency = recency.begin();
+        entries.emplace(file, std::move(entry));
+    }
+
+private:
+    struct Entry {
+        int rows = 0, cols = 0, type = 0;
+        bool compressed = false;
+        std::vector<uchar> bytes;
+        std::list<size_t>::iterator recency;
+    };
+
+    const size_t budgetBytes;
+    const bool compress;
+    size_t usedBytes = 0;
+    std::map<size_t, Entry> entries;
+    std::list<size_t> recency;
+
+    void evict(const std::map<size_t, Entry>::iterator entry) {
+        usedBytes -= entry->second.bytes.size();
+        recency.erase(entry->second.recency);
+        entries.erase(entry);
+    }
+};
+
+// Decodes through the cache when it's enabled, same result as cv::imread(path, cv::IMREAD_UNCHANGED) in orientation
+bool loadImage(const PathTable& paths, const size_t file, std::vector<uchar>& buffer, cv::Mat& image, DecodedImageCache& cache, ScanStats& stats, const int orientation, cv::Mat& spare) {
+    if (cache.enabled() && cache.lookup(file, image, stats)) {
+        return true;
+    }
+    if (!decodeInto(paths.c_str(file), buffer, image)) {
+        return false;
+    }
+    if (orientation != 0) {
+        orientImage(image, spare, orientation);
+        std::swap(image, spare);
+    }
+    if (cache.enabled()) {
+        cache.insert(file, image, stats);
+    }
+    return true;
+}
+
+// Full-resolution verification of a candidate pair, decoding each image once. Returns NULL optional if image load
+// failed, otherwise a similarity on the same side of the threshold as a full scan of every element (only an estimate
+// when options.estimate decided the pair from samples)
+const std::optional<const double> verifyPair(const PathTable& paths, const size_t file1, const size_t file2, const PixelSignature* signature1, const PixelSignature* signature2, ComparisonScratch& scratch, DecodedImageCache& cache, const ScanOptions& options, ScanStats& stats, const int orientation1 = 0, const int orientation2 = 0) {
+    {
+        AllocationScope decodeScope(stats.decodeAllocations, stats.decodeMatBuffers);
+        if (!loadImage(paths, file1, scratch.file1, scratch.image1, cache, stats, orientation1, scratch.oriented) ||
+            !loadImage(paths, file2, scratch.file2, scratch.image2, cache, stats, orientation2, scratch.oriented)) {
+            return std::nullopt;
+        }
+    }
+    AllocationScope compareScope(stats.compareAllocations, stats.compareAllocations);
+    scratch.measured = false;
+    const cv::Mat& image1Mat = scratch.image1;
+    const cv::Mat& image2Mat = scratch.image2;
+    if (image1Mat.rows != image2Mat.rows || image1Mat.cols != image2Mat.cols) {
+        return 0;
+    }
+    if (image1Mat.type() != image2Mat.type()) {
+        const EqualElementsKernel converted = options.normalizeFormats ? equalConvertedKernel(image1Mat.type(), image2Mat.type()) : nullptr;
+        if (converted == nullptr) {
+            return 0;
+        }
+        return (double)countEqualElements(image1Mat, image2Mat, converted) / (image1Mat.total() * convertedElements(image1Mat.type(), image2Mat.type()));
+    }
+    const EqualElementsKernel kernel = options.ignoreTransparent ? equalVisibleKernel(image1Mat.type()) : equalElementsKernel(image1Mat.type());
+    if (kernel == nullptr) {
+        return 0;
+    }
+
+    // SSIM, tolerance and error metrics each take one fused pass over every sample, none of the exact-equality shortcuts
+    // below apply
+    if (options.ssim) {
+        const SsimKernel ssim = ssimKernel(image1Mat.type());
+        if (ssim == nullptr) {
+            stats.ssimUnsupported++;
+            return 0;
+        }
+        return ssim(image1Mat, image2Mat, options.threshold, scratch.ssim);
+    }
+    const size_t totalElements = image1Mat.total() * image1Mat.channels();
+    const bool measure = options.pixelTolerance > 0 || options.errorMetrics;
+    const ErrorKernel errors = measure ? errorKernel(image1Mat.type()) : nullptr;
+    if (measure && errors == nullptr) {
+        stats.errorUnsupported++;
+        if (options.pixelTolerance > 0) {
+            return 0;
+        }
+    }
+    if (errors != nullptr) {
+        const bool wide = image1Mat.depth() == CV_16U;
+        const ErrorSums sums = accumulateErrors(image1Mat, image2Mat, errors, options.pixelTolerance * (wide ? 257 : 1));
+        const double peak = wide ? 65535 : 255;
+        const double meanSquaredError = (double)sums.squared / totalElements;
+        scratch.measured = true;
+        scratch.meanAbsoluteError = (double)sums.absolute / totalElements * 255 / peak;
+        scratch.psnr = meanSquaredError > 0 ? 10 * std::log10(peak * peak / meanSquaredError) : std::numeric_limits<double>::infinity();
+        return (double)sums.close / totalElements;
+    }
+
+    if (options.estimate && exactEqualityMetric(options) && options.estimateSamples < totalElements) {
+        const SimilarityEstimate estimate = estimateSimilarity(image1Mat, image2Mat, options.estimateSamples);
+        if (estimate.low >= options.threshold) {
+            stats.estimateAccepted++;
+            return estimate.low;
+        }
+        if (estimate.high < options.threshold) {
+            stats.estimateRejected++;
+            return estimate.high;
+        }
+        stats.estimateExact++;
+    }
+
+    if (signature1 != nullptr && signature2 != nullptr && signaturesComparable(*signature1, *signature2)) {
+        return (double)countEqualElementsTiled(image1Mat, image2Mat, kernel, *signature1, *signature2, stats) / totalElements;
+    }
+    return (double)countEqualElements(image1Mat, image2Mat, kernel) / totalElements;
+}
+
+std::string describeScanStats(const ScanOptions& options, const ScanStats& stats) {
+    std::ostringstream out;
+    if (options.orb.enabled) {
+        out << "ORB: " << stats.orbKeypoints << " keypoint" << (stats.orbKeypoints == 1 ? "" : "s") << " in " << std::setprecision(3) << stats.orbExtractSeconds << " s\n";
+    }
+    if (options.candidates != CandidateMode::Exhaustive || options.orb.enabled) {
+        out << "Candidates (" << (options.orb.enabled ? "orb votes" : candidateModeName(options.candidates)) << "): " << stats.candidatePairs << " candidate pair" << (stats.candidatePairs == 1 ? "" : "s") << " of " << stats.possiblePairs
+            << " in " << std::setprecision(3) << 1000 * stats.candidateSeconds << " ms\n";
+    }
+    if (options.scaleNormalized) {
+        out << "Scale-normalized: compared " << stats.possiblePairs << " pair" << (stats.possiblePairs == 1 ? "" : "s") << " with matching aspect ratios\n";
+    }
+    if (options.embedding.model.size() > 0 && stats.embeddingCores > 0) {
+        const double perSecond = stats.embeddingSeconds > 0 ? stats.embeddedImages / stats.embeddingSeconds : 0;
+        out << "Embedded " << stats.embeddedImages << " image" << (stats.embeddedImages == 1 ? "" : "s") << " in " << std::setprecision(3) << stats.embeddingSeconds
+            << " s on " << stats.embeddingCores << " core" << (stats.embeddingCores == 1 ? "" : "s") << " (" << perSecond / stats.embeddingCores << " images/sec/core)";
+        if (stats.embeddingFailures > 0) {
+            out << ", " << stats.embeddingFailures << " couldn't be embedded";
+        }
+        out << "\n";
+    }
+    if (stats.hnswSaveFailed) {
+        out << "Couldn't save the HNSW index to " << options.hnswIndexPath << "\n";
+    }
+    if (options.containerHash) {
+        out << "Container hashes: " << stats.containerMatched << " of " << stats.containerHashed << " JPEG/PNG file" << (stats.containerHashed == 1 ? "" : "s") << " matched without decoding\n";
+    }
+    out << "Histogram bound pruned " << stats.histogramPruned << " pair" << (stats.histogramPruned == 1 ? "" : "s");
+    if (options.pyramid) {
+        out << "\nPyramid comparison:";
+        for (size_t l = 0; l < pyramidLevels.size(); ++l) {
+            out << " " << stats.pyramidRejected[l] << " rejected at " << pyramidLevels[l] << "x" << pyramidLevels[l] << ",";
+        }
+        out << " " << stats.fullResolution << " passed every level";
+    }
+    if (stats.signaturesSkipped > 0) {
+        out << "\nMemory budget: " << stats.signaturesSkipped << " file signature" << (stats.signaturesSkipped == 1 ? "" : "s") << " skipped";
+    }
+    if (!stats.spilled.empty()) {
+        out << "\nSpilled to disk:";
+        for (size_t i = 0; i < stats.spilled.size(); ++i) {
+            out << (i == 0 ? " " : ", ") << stats.spilled[i];
+        }
+    }
+    if (options.cacheBytes > 0) {
+        out << "\nImage cache: " << stats.cacheHits << " hits, " << stats.cacheMisses << " misses, " << stats.cacheEvictions << " evictions";
+        if (options.cacheCompress && stats.cacheStoredBytes > 0) {
+            out << ", stored at " << std::setprecision(3) << 100.0 * stats.cacheStoredBytes / stats.cacheRawBytes << "% of decoded size, "
+                << std::setprecision(3) << 1000 * stats.cacheDecompressSeconds << " ms decompressing";
+        }
+    }
+#if defined(COUNT_ALLOCATIONS)
+    out << "\nHeap allocations during verification: " << stats.decodeAllocations << " decoding, " << stats.compareAllocations << " comparing";
+    out << "\nMat buffers decoded: " << stats.decodeMatBuffers << ", " << stats.warmMatBuffers << " after the first pair of a bucket";
+#endif
+    if (options.estimate) {
+        out << "\nSampling estimator: " << stats.estimateAccepted << " accepted, " << stats.estimateRejected << " rejected, " << stats.estimateExact << " needed a full scan";
+    }
+    if (stats.ssimUnsupported > 0) {
+        out << "\nSSIM: " << stats.ssimUnsupported << " pair" << (stats.ssimUnsupported == 1 ? "" : "s") << " not 8 or 16-bit unsigned, scored 0";
+    }
+    if (stats.errorUnsupported > 0) {
+        out << "\n" << (options.pixelTolerance > 0 ? "Pixel tolerance: " : "Error metrics: ") << stats.errorUnsupported << " pair" << (stats.errorUnsupported == 1 ? "" : "s")
+            << " not 8 or 16-bit unsigned, " << (options.pixelTolerance > 0 ? "scored 0" : "compared exactly without measuring");
+    }
+    if (options.errorMetrics && stats.measuredPairs > 0) {
+        out << "\nPixel error over " << stats.measuredPairs << " matched pair" << (stats.measuredPairs == 1 ? "" : "s") << ": mean absolute error "
+            << std::setprecision(3) << stats.absoluteErrorSum / stats.measuredPairs << " levels, lowest PSNR ";
+        if (std::isinf(stats.lowestPsnr)) {
+            out << "infinite (identical)";
+        }
+        else {
+            out << std::setprecision(3) << stats.lowestPsnr << " dB";
+        }
+    }
+    const size_t tiles = stats.tilesMatched + stats.tilesScanned;
+    if (tiles > 0) {
+        out << "\nTile hashes skipped " << stats.tilesMatched << " of " << tiles << " tiles during verification";
+    }
+    return out.str();
+}
+
+// Marks which of count column hashes lie within radius bits of hash. The compiler turns this into a vector loop only
+// where the instruction set has a vector popcount (VPOPCNTDQ); below that every hash costs one scalar POPCNT
+KERNEL_INLINE void markWithinRadius(const uint64_t hash, const uint64_t* columns, const size_t count, const int radius, uint8_t* within) {
+    for (size_t j = 0; j < count; ++j) {
+        within[j] = popcount64(hash ^ columns[j]) <= radius;
+    }
+}
+
+#if defined(KERNEL_MULTIVERSIONING)
+// AVX2 has no vector popcount, so four hashes at a time are counted with PSHUFB as a 16-entry table of nibble bit
+// counts (Mula's method) and the bytes of each hash summed with PSADBW; about 1.5x the scalar POPCNT loop
+KERNEL_TARGET_AVX2 void markWithinRadiusNibbleLookup(const uint64_t hash, const uint64_t* columns, const size_t count, const int radius, uint8_t* within) {
+    // Byte j of entry m is bit j of m, so the four compare results of one step are stored with a single write
+    static const uint32_t spreadBits[16] = {0x00000000, 0x00000001, 0x00000100, 0x00000101, 0x00010000, 0x00010001, 0x00010100, 0x00010101,
+                                            0x01000000, 0x01000001, 0x01000100, 0x01000101, 0x01010000, 0x01010001, 0x01010100, 0x01010101};
+    const __m256i nibbleCounts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibbles = _mm256_set1_epi8(0x0f);
+    const __m256i query = _mm256_set1_epi64x((long long)hash);
+    const __m256i limit = _mm256_set1_epi64x(radius + 1);
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4) {
+        const __m256i difference = _mm256_xor_si256(query, _mm256_loadu_si256((const __m256i*)(columns + j)));
+        const __m256i low = _mm256_shuffle_epi8(nibbleCounts, _mm256_and_si256(difference, lowNibbles));
+        const __m256i high = _mm256_shuffle_epi8(nibbleCounts, _mm256_and_si256(_mm256_srli_epi16(difference, 4), lowNibbles));
+        const __m256i distances = _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256());
+        const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(limit, distances)));
+        std::memcpy(within + j, &spreadBits[mask], sizeof(uint32_t));
+    }
+    markWithinRadius(hash, columns + j, count - j, radius, within + j);
+}
+#endif
+
+using MarkWithinKernel = void (*)(uint64_t, const uint64_t*, size_t, int, uint8_t*);
+
+#if defined(KERNEL_MULTIVERSIONING)
+KERNEL_TARGET_SSE42 void markWithinRadiusPopcnt(const uint64_t hash, const uint64_t* columns, const size_t count, const int radius, uint8_t* within) {
+    markWithinRadius(hash, columns, count, radius, within);
+}
+
+KERNEL_TARGET_AVX512_POPCNT void markWithinRadiusVectorPopcount(const uint64_t hash, const uint64_t* columns, const size_t count, const int radius, uint8_t* within) {
+    markWithinRadius(hash, columns, count, radius, within);
+}
+#endif
+
+// Standalone variant for this host, with the same popcount the Hamming scan uses
+MarkWithinKernel markWithinKernel() {
+#if defined(KERNEL_MULTIVERSIONING)
+    if (hasVectorPopcount()) {
+        return markWithinRadiusVectorPopcount;
+    }
+    return selectKernel<MarkWithinKernel>(markWithinRadius, markWithinRadiusPopcnt, markWithinRadiusNibbleLookup, markWithinRadiusNibbleLookup);
+#else
+    return markWithinRadius;
+#endif
+}
+
+const uint32_t noMember = UINT32_MAX;
+
+// BK-tree over 64-bit hashes with Hamming distance, indexing the members of one bucket. Nodes live in one flat array
+// and reach their children through a first-child/next-sibling chain, so every node is 24 bytes however many children
+// it has. Members with identical hashes share a node through sameHash. Both arrays spill past limitBytes
+struct BkTree {
+    struct Node {
+        uint64_t hash;
+        uint32_t member, firstChild, nextSibling, distance;
+    };
+
+    explicit BkTree(const size_t limitBytes) : nodes(limitBytes - limitBytes / 7), sameHash(limitBytes / 7) {}
+
+    SpillVector<Node> nodes;
+    // Next member with the same hash, noMember ends the chain (members are inserted in order, so indices line up)
+    SpillVector<uint32_t> sameHash;
+};
+
+KERNEL_INLINE void bkTreeInsert(BkTree& tree, const uint64_t hash) {
+    const uint32_t member = (uint32_t)tree.sameHash.size();
+    tree.sameHash.push_back(noMember);
+    if (tree.nodes.size() == 0) {
+        tree.nodes.push_back({hash, member, noMember, noMember, 0});
+        return;
+    }
+
+    uint32_t current = 0;
+    while (true) {
+        const uint32_t distance = popcount64(tree.nodes[current].hash ^ hash);
+        if (distance == 0) {
+            const uint32_t head = tree.nodes[current].member;
+            tree.sameHash[member] = tree.sameHash[head];
+            tree.sameHash[head] = member;
+            return;
+        }
+        uint32_t child = tree.nodes[current].firstChild;
+        while (child != noMember && tree.nodes[child].distance != distance) {
+            child = tree.nodes[child].nextSibling;
+        }
+        if (child == noMember) {
+            tree.nodes.push_back({hash, member, noMember, tree.nodes[current].firstChild, distance});
+            tree.nodes[current].firstChild = (uint32_t)tree.nodes.size() - 1;
+            return;
+        }
+        current = child;
+    }
+}
+
+// Calls visit for every member within radius bits of hash. By the triangle inequality only children whose edge distance
+// is within radius of the query's distance to their parent can hold a match
+template <typename Visitor>
+KERNEL_INLINE void bkTreeQuery(const BkTree& tree, const uint64_t hash, const int radius, std::vector<uint32_t>& stack, Visitor visit) {
+    if (tree.nodes.size() == 0) {
+        return;
+    }
+    stack.assign(1, 0);
+    while (!stack.empty()) {
+        const BkTree::Node& node = tree.nodes[stack.back()];
+        stack.pop_back();
+        const int distance = popcount64(node.hash ^ hash);
+        if (distance <= radius) {
+            for (uint32_t member = node.member; member != noMember; member = tree.sameHash[member]) {
+                visit(member);
+            }
+        }
+        for (uint32_t child = node.firstChild; child != noMember; child = tree.nodes[child].nextSibling) {
+            if (std::abs((int)tree.nodes[child].distance - distance) <= radius) {
+                stack.push_back(child);
+            }
+        }
+    }
+}
+
+// Appends every pair of members (first < second) whose hashes are within radius bits
+KERNEL_INLINE void bkTreePairs(const uint64_t* hashes, const size_t count, const int radius, const size_t indexBytes, SpillVector<MatchEdge>& pairs) {
+    BkTree tree(indexBytes);
+    for (size_t i = 0; i < count; ++i) {
+        bkTreeInsert(tree, hashes[i]);
+    }
+    std::vector<uint32_t> stack;
+    for (size_t i = 0; i < count; ++i) {
+        bkTreeQuery(tree, hashes[i], radius, stack, [&](const uint32_t member) {
+            if (member > i) {
+                pairs.push_back({(uint32_t)i, member});
+            }
+        });
+    }
+}
+
+#if defined(KERNEL_MULTIVERSIONING)
+// The search is scalar, so what a target level changes is only its popcount: one POPCNT instead of libgcc's bit tricks
+KERNEL_TARGET_SSE42 void bkTreePairsPopcnt(const uint64_t* hashes, const size_t count, const int radius, const size_t indexBytes, SpillVector<MatchEdge>& pairs) {
+    bkTreePairs(hashes, count, radius, indexBytes, pairs);
+}
+#endif
+
+// Number of substrings multi-index hashing cuts a hash into. More substrings mean a smaller search radius per
+// substring (fewer probe keys) but shorter keys that collide more often, so this picks the cheapest by estimating
+// probes per table times the expected members sharing each probed key
+int multiIndexSubstrings(const size_t count, const int radius) {
+    int best = 2;
+    double bestCost = std::numeric_limits<double>::max();
+    for (int substrings = 2; substrings <= std::max(2, std::min(radius + 1, 32)); ++substrings) {
+        const int width = 64 / substrings;
+        double probes = 0, combinations = 1;
+        for (int flips = 0; flips <= radius / substrings; ++flips) {
+            probes += combinations;
+            combinations = combinations * (width - flips) / (flips + 1);
+        }
+        const double cost = substrings * probes * (1 + count / std::ldexp(1.0, width));
+        if (cost < bestCost) {
+            best = substrings;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
+
+// Appends key and every key that differs from it in at most radius of the bits from firstBit up to width
+void appendNeighbourKeys(const uint32_t key, const int firstBit, const int width, const int radius, std::vector<uint32_t>& keys) {
+    keys.push_back(key);
+    if (radius == 0) {
+        return;
+    }
+    for (int bit = firstBit; bit < width; ++bit) {
+        appendNeighbourKeys(key ^ (1u << bit), bit + 1, width, radius - 1, keys);
+    }
+}
+
+// Pairs within radius bits, found by probing one sorted table per hash substring within radius / m bits
+void multiIndexPairs(const uint64_t* hashes, const size_t count, const int radius, const size_t indexBytes, SpillVector<MatchEdge>& pairs) {
+    const int substrings = multiIndexSubstrings(count, radius);
+    const int substringRadius = radius / substrings;
+    std::vector<int> firstBits(substrings + 1);
+    for (int s = 0; s <= substrings; ++s) {
+        firstBits[s] = s * 64 / substrings;
+    }
+    auto substring = [&](const uint64_t hash, const int s) {
+        const int width = firstBits[s + 1] - firstBits[s];
+        return (uint32_t)((hash >> firstBits[s]) & ((uint64_t(1) << width) - 1));
+    };
+
+    struct Entry {
+        uint32_t key, member;
+    };
+    auto before = [](const Entry& a, const Entry& b) {
+        return std::tie(a.key, a.member) < std::tie(b.key, b.member);
+    };
+    const size_t shareBytes = indexBytes / (substrings + 1);
+    std::deque<SpillVector<Entry>> tables;
+    for (int s = 0; s < substrings; ++s) {
+        tables.emplace_back(shareBytes);
+        for (size_t i = 0; i < count; ++i) {
+            tables[s].push_back({substring(hashes[i], s), (uint32_t)i});
+        }
+        std::sort(tables[s].begin(), tables[s].end(), before);
+    }
+
+    // seenBy[j] == i once j has been checked against member i, since j can turn up in several tables
+    SpillVector<uint32_t> seenBy(shareBytes);
+    seenBy.resize(count);
+    std::fill(seenBy.begin(), seenBy.end(), noMember);
+    const MarkWithinKernel markWithin = markWithinKernel();
+    std::vector<uint32_t> keys, candidates;
+    std::vector<uint64_t> candidateHashes;
+    std::vector<uint8_t> within;
+    for (size_t i = 0; i < count; ++i) {
+        candidates.clear();
+        candidateHashes.clear();
+        for (int s = 0; s < substrings; ++s) {
+            keys.clear();
+            appendNeighbourKeys(substring(hashes[i], s), 0, firstBits[s + 1] - firstBits[s], substringRadius, keys);
+            for (const uint32_t key : keys) {
+                const Entry* entry = std::lower_bound(tables[s].begin(), tables[s].end(), Entry{key, 0}, before);
+                for (; entry != tables[s].end() && entry->key == key; ++entry) {
+                    const uint32_t member = entry->member;
+                    if (member <= i || seenBy[member] == i) {
+                        continue;
+                    }
+                    seenBy[member] = (uint32_t)i;
+                    candidates.push_back(member);
+                    candidateHashes.push_back(hashes[member]);
+                }
+            }
+        }
+        within.resize(candidates.size());
+        markWithin(hashes[i], candidateHashes.data(), candidates.size(), radius, within.data());
+        for (size_t c = 0; c < candidates.size(); ++c) {
+            if (within[c]) {
+                pairs.push_back({(uint32_t)i, candidates[c]});
+            }
+        }
+    }
+}
+
+// Hashes per side of a Hamming scan tile: two 8 KB blocks of hashes stay in L1 while every row is checked against
+// every column
+const size_t hammingTile = 1024;
+// Pairs a search thread collects before moving them to the shared list
+const size_t pairBatchSize = 4096;
+
+// Pairs found by one thread of a parallel search, moved into the shared (spilling) list a batch at a time so no thread
+// holds more than one batch of its own. Batches from different threads interleave, so the list needs sorting after
+struct PairBatch {
+    SpillVector<MatchEdge>& pairs;
+    std::mutex& lock;
+    std::vector<MatchEdge> pending;
+
+    void push_back(const MatchEdge& pair) {
+        pending.push_back(pair);
+        if (pending.size() >= pairBatchSize) {
+            flush();
+        }
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (const MatchEdge& pair : pending) {
+            pairs.push_back(pair);
+        }
+        pending.clear();
+    }
+};
+
+// Checks rows [rowBegin, rowEnd) against the columns after them, one column tile at a time. Distances for a row are
+// written to a mask first so the popcount loop has no branches
+template <MarkWithinKernel MarkWithin>
+KERNEL_INLINE void hammingScanRows(const uint64_t* hashes, const size_t count, const size_t rowBegin, const size_t rowEnd, const int radius, PairBatch& pairs) {
+    uint8_t within[hammingTile];
+    for (size_t columnBegin = rowBegin; columnBegin < count; columnBegin += hammingTile) {
+        const size_t columnEnd = std::min(columnBegin + hammingTile, count);
+        for (size_t i = rowBegin; i < rowEnd; ++i) {
+            const size_t first = std::max(columnBegin, i + 1);
+            if (first >= columnEnd) {
+                continue;
+            }
+            MarkWithin(hashes[i], hashes + first, columnEnd - first, radius, within);
+            for (size_t j = first; j < columnEnd; ++j) {
+                if (within[j - first]) {
+                    pairs.push_back({(uint32_t)i, (uint32_t)j});
+                }
+            }
+        }
+    }
+}
+
+#if defined(KERNEL_MULTIVERSIONING)
+KERNEL_TARGET_SSE42 void hammingScanRowsSse42(const uint64_t* hashes, const size_t count, const size_t rowBegin, const size_t rowEnd, const int radius, PairBatch& pairs) {
+    hammingScanRows<markWithinRadius>(hashes, count, rowBegin, rowEnd, radius, pairs);
+}
+
+KERNEL_TARGET_AVX2 void hammingScanRowsAvx2(const uint64_t* hashes, const size_t count, const size_t rowBegin, const size_t rowEnd, const int radius, PairBatch& pairs) {
+    hammingScanRows<markWithinRadiusNibbleLookup>(hashes, count, rowBegin, rowEnd, radius, pairs);
+}
+
+KERNEL_TARGET_AVX512 void hammingScanRowsAvx512(const uint64_t* hashes, const size_t count, const size_t rowBegin, const size_t rowEnd, const int radius, PairBatch& pairs) {
+    hammingScanRows<markWithinRadiusNibbleLookup>(hashes, count, rowBegin, rowEnd, radius, pairs);
+}
+
+KERNEL_TARGET_AVX512_POPCNT void hammingScanRowsAvx512Popcnt(const uint64_t* hashes, const size_t count, const size_t rowBegin, const size_t rowEnd, const int radius, PairBatch& pairs) {
+    hammingScanRows<markWithinRadius>(hashes, count, rowBegin, rowEnd, radius, pairs);
+}
+#endif
+
+using HammingRowsKernel = void (*)(const uint64_t*, size_t, size_t, size_t, int, PairBatch&);
+
+// The variants differ in how they popcount, not just in register width, so they're written out instead of going
+// through MULTIVERSION_KERNEL
+HammingRowsKernel hammingRowsKernel() {
+#if defined(KERNEL_MULTIVERSIONING)
+    if (hasVectorPopcount()) {
+        return hammingScanRowsAvx512Popcnt;
+    }
+    return selectKernel<HammingRowsKernel>(hammingScanRows<markWithinRadius>, hammingScanRowsSse42, hammingScanRowsAvx2, hammingScanRowsAvx512);
+#else
+    return hammingScanRows<markWithinRadius>;
+#endif
+}
+
+// Every pair of members within radius bits, found by checking all of them. Row tiles are dealt out round-robin so the
+// threads get a similar share of the triangle; the cost only depends on count, which makes it the baseline the
+// indexes are measured against. It builds no index, so indexBytes goes unused. Pairs come out unsorted
+void hammingScanPairs(const uint64_t* hashes, const size_t count, const int radius, const size_t indexBytes, SpillVector<MatchEdge>& pairs) {
+    const HammingRowsKernel kernel = hammingRowsKernel();
+    const size_t rowTiles = (count + hammingTile - 1) / hammingTile;
+    const size_t threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), rowTiles));
+    std::mutex lock;
+    auto scanTiles = [&](const size_t thread) {
+        PairBatch found{pairs, lock, {}};
+        for (size_t tile = thread; tile < rowTiles; tile += threads) {
+            kernel(hashes, count, tile * hammingTile, std::min((tile + 1) * hammingTile, count), radius, found);
+        }
+        found.flush();
+    };
+    std::vector<std::future<void>> workers;
+    for (size_t thread = 1; thread < threads; ++thread) {
+        workers.push_back(std::async(std::launch::async, scanTiles, thread));
+    }
+    scanTiles(0);
+    for (auto& worker : workers) {
+        worker.get();
+    }
+}
+
+using HashPairsKernel = void (*)(const uint64_t*, size_t, int, size_t, SpillVector<MatchEdge>&);
+
+HashPairsKernel bkTreeKernel() {
+#if defined(KERNEL_MULTIVERSIONING)
+    if (cpuLevel() >= CpuLevel::Sse42) {
+        return bkTreePairsPopcnt;
+    }
+#endif
+    return bkTreePairs;
+}
+
+HashPairsKernel hashPairsKernel(const CandidateMode mode) {
+    if (mode == CandidateMode::HammingScan) {
+        return hammingScanPairs;
+    }
+    return mode == CandidateMode::MultiIndex ? multiIndexPairs : bkTreeKernel();
+}
+
+void sortCandidatePairs(SpillVector<MatchEdge>& pairs) {
+    std::sort(pairs.begin(), pairs.end(), [](const MatchEdge& a, const MatchEdge& b) {
+        return std::tie(a.file1, a.file2) < std::tie(b.file1, b.file2);
+    });
+}
+
+// Rows per block of the all-pairs product: a 512x256 float block is 512 KB, so a pair of them and their 1 MB product
+// sit in L2/L3 while cv::gemm (or the BLAS OpenCV was built with) multiplies them
+const int cosineBlock = 512;
+
+// Pairs of rows whose dot product reaches threshold, by blocked products; flat (all-zero) rows only pair with each other
+void cosinePairs(const cv::Mat& vectors, const double threshold, const size_t indexBytes, SpillVector<MatchEdge>& pairs) {
+    SpillVector<uint8_t> isFlat(indexBytes / 8);
+    SpillVector<uint32_t> flat(indexBytes - indexBytes / 8);
+    isFlat.resize(vectors.rows);
+    for (int i = 0; i < vectors.rows; ++i) {
+        if (cv::countNonZero(vectors.row(i)) == 0) {
+            isFlat[i] = 1;
+            flat.push_back((uint32_t)i);
+        }
+    }
+    for (size_t a = 0; a < flat.size(); ++a) {
+        for (size_t b = a + 1; b < flat.size(); ++b) {
+            pairs.push_back({flat[a], flat[b]});
+        }
+    }
+
+    cv::Mat similarity;
+    for (int rowBegin = 0; rowBegin < vectors.rows; rowBegin += cosineBlock) {
+        const cv::Mat rows = vectors.rowRange(rowBegin, std::min(rowBegin + cosineBlock, vectors.rows));
+        for (int columnBegin = rowBegin; columnBegin < vectors.rows; columnBegin += cosineBlock) {
+            const cv::Mat columns = vectors.rowRange(columnBegin, std::min(columnBegin + cosineBlock, vectors.rows));
+            cv::gemm(rows, columns, 1.0, cv::noArray(), 0.0, similarity, cv::GEMM_2_T);
+            for (int i = 0; i < similarity.rows; ++i) {
+                if (isFlat[rowBegin + i]) {
+                    continue;
+                }
+                const float* row = similarity.ptr<float>(i);
+                for (int j = std::max(0, rowBegin + i + 1 - columnBegin); j < similarity.cols; ++j) {
+                    if (row[j] >= threshold && !isFlat[columnBegin + j]) {
+                        pairs.push_back({(uint32_t)(rowBegin + i), (uint32_t)(columnBegin + j)});
+                    }
+                }
+            }
+        }
+    }
+}
+
+const int thumbnailVectorLength = thumbnailVectorSide * thumbnailVectorSide;
+
+// Without -ffast-math the compiler may not reorder a float sum, so a single accumulator stays scalar. Eight
+// independent partial sums give it the vector lanes explicitly
+KERNEL_INLINE float dotProduct(const float* a, const float* b) {
+    static_assert(thumbnailVectorLength % 8 == 0, "dotProduct sums eight lanes at a time");
+    float sums[8] = {};
+    for (int i = 0; i < thumbnailVectorLength; i += 8) {
+        for (int lane = 0; lane < 8; ++lane) {
+            sums[lane] += a[i + lane] * b[i + lane];
+        }
+    }
+    return ((sums[0] + sums[4]) + (sums[1] + sums[5])) + ((sums[2] + sums[6]) + (sums[3] + sums[7]));
+}
+
+MULTIVERSION_KERNEL((), float, dotProduct, (const float* a, const float* b), ((a, b)))
+
+using DotKernel = float (*)(const float*, const float*);
+
+DotKernel dotKernel() {
+    return SELECT_KERNEL(DotKernel, dotProduct, ());
+}
+
+// HNSW graph over one bucket's thumbnail vectors, each node's length-prefixed lists packed from firstLink[node]
+struct HnswGraph {
+    explicit HnswGraph(const size_t limitBytes) : levels(limitBytes / 16), firstLink(limitBytes / 8), links(limitBytes - limitBytes / 16 - limitBytes / 8) {}
+
+    int m = 16;
+    uint32_t entryPoint = noMember;
+    int topLevel = -1;
+    SpillVector<uint8_t> levels;
+    // Offset of each node's lists in links, followed by the total
+    SpillVector<uint64_t> firstLink;
+    SpillVector<uint32_t> links;
+
+    int capacity(const int level) const {
+        return level == 0 ? 2 * m : m;
+    }
+    size_t listOffset(const int level) const {
+        return level == 0 ? 0 : (size_t)(2 * m + 1) + (size_t)(level - 1) * (m + 1);
+    }
+    size_t nodes() const {
+        return levels.size();
+    }
+    uint32_t* list(const uint32_t node, const int level) {
+        return &links[firstLink[node] + listOffset(level)];
+    }
+    const uint32_t* list(const uint32_t node, const int level) const {
+        return &links[firstLink[node] + listOffset(level)];
+    }
+
+    // Lays out empty lists for every level of every node once levels is filled in
+    void allocateLinks() {
+        firstLink.resize(0);
+        uint64_t total = 0;
+        for (size_t node = 0; node < nodes(); ++node) {
+            firstLink.push_back(total);
+            total += listOffset(levels[node] + 1);
+        }
+        firstLink.push_back(total);
+        links.resize(0);
+        links.resize(total);
+    }
+};
+
+// Working state of one thread searching the graph: visit marks are stamped with a generation so they never need
+// clearing between searches
+struct HnswSearcher {
+    explicit HnswSearcher(const size_t limitBytes) : visited(limitBytes) {}
+
+    SpillVector<uint32_t> visited;
+    uint32_t generation = 0;
+    std::vector<std::pair<float, uint32_t>> candidates, results;
+
+    void reset(const size_t nodes) {
+        if (visited.size() != nodes || ++generation == 0) {
+            visited.resize(0);
+            visited.resize(nodes);
+            generation = 1;
+        }
+    }
+};
+
+// Mutexes guarding the link lists while a graph is built, node n using lockStripes[n % hnswLockStripes]. A thread never
+// holds two of them at once, so sharing one between nodes can't deadlock and the count doesn't grow with the bucket
+const size_t hnswLockStripes = 4096;
+
+// Up to ef nodes nearest query on one level, nearest first. locks is null once the graph is no longer being built
+std::vector<std::pair<float, uint32_t>> hnswSearchLayer(const HnswGraph& graph, const float* vectors, const float* query, const uint32_t entry, const int ef, const int level, HnswSearcher& searcher, std::mutex* locks, const DotKernel dot) {
+    auto distance = [&](const uint32_t node) {
+        return 1 - dot(query, vectors + (size_t)node * thumbnailVectorLength);
+    };
+    auto farthestFirst = [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) { return a < b; };
+    auto nearestFirst = [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) { return a > b; };
+
+    searcher.reset(graph.nodes());
+    searcher.candidates.assign(1, {distance(entry), entry});
+    searcher.results = searcher.candidates;
+    searcher.visited[entry] = searcher.generation;
+    std::vector<uint32_t> neighbours;
+    while (!searcher.candidates.empty()) {
+        std::pop_heap(searcher.candidates.begin(), searcher.candidates.end(), nearestFirst);
+        const auto [nearest, node] = searcher.candidates.back();
+        searcher.candidates.pop_back();
+        if (nearest > searcher.results.front().first && searcher.results.size() >= (size_t)ef) {
+            break;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock;
+            if (locks != nullptr) {
+                lock = std::unique_lock<std::mutex>(locks[node % hnswLockStripes]);
+            }
+            const uint32_t* list = graph.list(node, level);
+            neighbours.assign(list + 1, list + 1 + list[0]);
+        }
+        for (const uint32_t neighbour : neighbours) {
+            if (searcher.visited[neighbour] == searcher.generation) {
+                continue;
+            }
+            searcher.visited[neighbour] = searcher.generation;
+            const float d = distance(neighbour);
+            if (searcher.results.size() < (size_t)ef || d < searcher.results.front().first) {
+                searcher.candidates.push_back({d, neighbour});
+                std::push_heap(searcher.candidates.begin(), searcher.candidates.end(), nearestFirst);
+                searcher.results.push_back({d, neighbour});
+                std::push_heap(searcher.results.begin(), searcher.results.end(), farthestFirst);
+                if (searcher.results.size() > (size_t)ef) {
+                    std::pop_heap(searcher.results.begin(), searcher.results.end(), farthestFirst);
+                    searcher.results.pop_back();
+                }
+            }
+        }
+    }
+    std::sort_heap(searcher.results.begin(), searcher.results.end(), farthestFirst);
+    return searcher.results;
+}
+
+// Keeps a candidate (nearest first) only if it is closer to the node than to every neighbour already kept, which
+// spreads links in different directions instead of spending them all on one tight cluster
+std::vector<uint32_t> hnswSelectNeighbours(const std::vector<std::pair<float, uint32_t>>& candidates, const int count, const float* vectors, const DotKernel dot) {
+    std::vector<uint32_t> selected;
+    for (const auto& [distance, candidate] : candidates) {
+        if (selected.size() >= (size_t)count) {
+            break;
+        }
+        const float* vector = vectors + (size_t)candidate * thumbnailVectorLength;
+        bool diverse = true;
+        for (const uint32_t kept : selected) {
+            if (1 - dot(vector, vectors + (size_t)kept * thumbnailVectorLength) < distance) {
+                diverse = false;
+                break;
+            }
+        }
+        if (diverse) {
+            selected.push_back(candidate);
+        }
+    }
+    return selected;
+}
+
+// Level of a node, drawn from the geometric distribution HNSW needs but seeded by the node's index so a graph built
+// by any number of threads gets the same layers
+int hnswLevel(const uint32_t node, const int m) {
+    uint64_t state = (node + 1) * 0x9E3779B97F4A7C15ull;
+    state = (state ^ (state >> 30)) * 0xBF58476D1CE4E5B9ull;
+    state = (state ^ (state >> 27)) * 0x94D049BB133111EBull;
+    state ^= state >> 31;
+    const double uniform = ((state >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    return std::min((int)(-std::log(uniform) / std::log((double)std::max(m, 2))), 255);
+}
+
+void hnswInsert(HnswGraph& graph, const float* vectors, const uint32_t node, const int efConstruction, HnswSearcher& searcher, std::mutex& entryLock, std::mutex* locks, const DotKernel dot) {
+    const int level = graph.levels[node];
+    const float* query = vectors + (size_t)node * thumbnailVectorLength;
+
+    // A node that raises the top level keeps the entry lock for its whole insertion, as hnswlib does
+    std::unique_lock<std::mutex> entry(entryLock);
+    if (graph.entryPoint == noMember) {
+        graph.entryPoint = node;
+        graph.topLevel = level;
+        return;
+    }
+    const int topLevel = graph.topLevel;
+    uint32_t current = graph.entryPoint;
+    if (level <= topLevel) {
+        entry.unlock();
+    }
+
+    for (int l = topLevel; l > level; --l) {
+        current = hnswSearchLayer(graph, vectors, query, current, 1, l, searcher, locks, dot).front().second;
+    }
+    for (int l = std::min(level, topLevel); l >= 0; --l) {
+        const auto nearest = hnswSearchLayer(graph, vectors, query, current, efConstruction, l, searcher, locks, dot);
+        const std::vector<uint32_t> neighbours = hnswSelectNeighbours(nearest, graph.m, vectors, dot);
+        {
+            std::lock_guard<std::mutex> lock(locks[node % hnswLockStripes]);
+            uint32_t* list = graph.list(node, l);
+            list[0] = (uint32_t)neighbours.size();
+            std::copy(neighbours.begin(), neighbours.end(), list + 1);
+        }
+        for (const uint32_t neighbour : neighbours) {
+            std::lock_guard<std::mutex> lock(locks[neighbour % hnswLockStripes]);
+            uint32_t* list = graph.list(neighbour, l);
+            if (list[0] < (uint32_t)graph.capacity(l)) {
+                list[1 + list[0]++] = node;
+                continue;
+            }
+            // Full: keep the most diverse of the old links plus the new one
+            const float* vector = vectors + (size_t)neighbour * thumbnailVectorLength;
+            std::vector<std::pair<float, uint32_t>> options;
+            for (uint32_t i = 0; i <= list[0]; ++i) {
+                const uint32_t other = i < list[0] ? list[1 + i] : node;
+                options.push_back({1 - dot(vector, vectors + (size_t)other * thumbnailVectorLength), other});
+            }
+            std::sort(options.begin(), options.end());
+            const std::vector<uint32_t> kept = hnswSelectNeighbours(options, graph.capacity(l), vectors, dot);
+            list[0] = (uint32_t)kept.size();
+            std::copy(kept.begin(), kept.end(), list + 1);
+        }
+        current = nearest.front().second;
+    }
+
+    if (entry.owns_lock() && level > graph.topLevel) {
+        graph.entryPoint = node;
+        graph.topLevel = level;
+    }
+}
+
+// Builds the graph over count vectors with one inserting thread per core, each node's lists locked while they change.
+// The insertion order and the threads' visit marks spill past searchBytes between them
+void buildHnswGraph(const float* vectors, const size_t count, const HnswParameters& parameters, const size_t searchBytes, HnswGraph& graph) {
+    graph.m = std::max(parameters.m, 2);
+    graph.entryPoint = noMember;
+    graph.topLevel = -1;
+    graph.levels.resize(0);
+    for (size_t node = 0; node < count; ++node) {
+        graph.levels.push_back((uint8_t)hnswLevel((uint32_t)node, graph.m));
+    }
+    graph.allocateLinks();
+
+    const DotKernel dot = dotKernel();
+    std::unique_ptr<std::mutex[]> locks(new std::mutex[hnswLockStripes]);
+    std::mutex entryLock;
+    // Nodes inserted at the same time can't link to each other, and neighbouring files are the likeliest duplicates, so
+    // they are inserted in a shuffled (but fixed) order
+    SpillVector<uint32_t> order(searchBytes / 2);
+    for (size_t node = 0; node < count; ++node) {
+        order.push_back((uint32_t)node);
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937((uint32_t)count));
+    const size_t threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), count / 256));
+    std::atomic<size_t> next(0);
+    auto insertNodes = [&]() {
+        HnswSearcher searcher(searchBytes / 2 / threads);
+        for (size_t position = next++; position < count; position = next++) {
+            hnswInsert(graph, vectors, order[position], std::max(parameters.efConstruction, graph.m), searcher, entryLock, locks.get(), dot);
+        }
+    };
+    std::vector<std::future<void>> workers;
+    for (size_t thread = 1; thread < threads; ++thread) {
+        workers.push_back(std::async(std::launch::async, insertNodes));
+    }
+    insertNodes();
+    for (auto& worker : workers) {
+        worker.get();
+    }
+}
+
+// The k nodes nearest query (fewer if the graph is smaller), nearest first, searching ef candidates on level 0
+std::vector<std::pair<float, uint32_t>> hnswNearest(const HnswGraph& graph, const float* vectors, const float* query, const size_t k, const int ef, HnswSearcher& searcher, const DotKernel dot) {
+    if (graph.entryPoint == noMember) {
+        return {};
+    }
+    uint32_t current = graph.entryPoint;
+    for (int level = graph.topLevel; level > 0; --level) {
+        current = hnswSearchLayer(graph, vectors, query, current, 1, level, searcher, nullptr, dot).front().second;
+    }
+    auto nearest = hnswSearchLayer(graph, vectors, query, current, std::max(ef, (int)k), 0, searcher, nullptr, dot);
+    nearest.resize(std::min(nearest.size(), k));
+    return nearest;
+}
+
+// Radius query for every node: pairs whose cosine similarity reaches threshold among each node's efSearch nearest.
+// Queries run on one thread per core, whose visit marks spill past searchBytes between them
+void hnswPairs(const HnswGraph& graph, const float* vectors, const size_t count, const double threshold, const int efSearch, const size_t searchBytes, SpillVector<MatchEdge>& pairs) {
+    const DotKernel dot = dotKernel();
+    const size_t threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), count / 256));
+    std::mutex lock;
+    auto queryNodes = [&](const size_t thread) {
+        HnswSearcher searcher(searchBytes / threads);
+        PairBatch found{pairs, lock, {}};
+        for (size_t node = thread; node < count; node += threads) {
+            for (const auto& [distance, other] : hnswNearest(graph, vectors, vectors + node * thumbnailVectorLength, efSearch, efSearch, searcher, dot)) {
+                if (other != node && 1 - distance >= threshold) {
+                    found.push_back({(uint32_t)std::min<size_t>(node, other), (uint32_t)std::max<size_t>(node, other)});
+                }
+            }
+        }
+        found.flush();
+    };
+    std::vector<std::future<void>> workers;
+    for (size_t thread = 1; thread < threads; ++thread) {
+        workers.push_back(std::async(std::launch::async, queryNodes, thread));
+    }
+    queryNodes(0);
+    for (auto& worker : workers) {
+        worker.get();
+    }
+
+    // Both ends of a pair usually find each other
+    sortCandidatePairs(pairs);
+    MatchEdge* last = std::unique(pairs.begin(), pairs.end(), [](const MatchEdge& a, const MatchEdge& b) {
+        return a.file1 == b.file1 && a.file2 == b.file2;
+    });
+    pairs.resize(last - pairs.begin());
+}
+
+// Stored graphs (--hnsw-index) keyed by vectors and parameters, read on demand and rewritten to path + ".new"
+struct HnswStore {
+    std::string path;
+    std::ifstream in;
+    std::map<uint64_t, uint64_t> offsets;
+    std::ofstream out;
+    std::set<uint64_t> written;
+};
+
+uint64_t hnswKey(const float* vectors, const size_t count, const HnswParameters& parameters) {
+    return hashBytes((const uchar*)vectors, count * thumbnailVectorLength * sizeof(float), ((uint64_t)parameters.m << 32) | (uint32_t)parameters.efConstruction);
+}
+
+// Every graph is stored as its key, m, entry point, top level, node count and link count, then the levels and the links
+const char hnswMagic[8] = {'I', 'D', 'D', 'H', 'N', 'S', 'W', '2'};
+
+// A stored graph is only trusted if it is one buildHnswGraph could have produced with these parameters: a corrupt or
+// foreign file must not send a search out of bounds
+bool validHnswGraph(const HnswGraph& graph, const HnswParameters& parameters) {
+    const size_t nodes = graph.nodes();
+    if (graph.m != std::max(parameters.m, 2) || nodes == 0 || graph.entryPoint >= nodes) {
+        return false;
+    }
+    int topLevel = 0;
+    for (size_t node = 0; node < nodes; ++node) {
+        topLevel = std::max<int>(topLevel, graph.levels[node]);
+        for (int level = 0; level <= graph.levels[node]; ++level) {
+            const uint32_t* list = graph.list((uint32_t)node, level);
+            if (list[0] > (uint32_t)graph.capacity(level)) {
+                return false;
+            }
+            for (uint32_t i = 1; i <= list[0]; ++i) {
+                if (list[i] >= nodes) {
+                    return false;
+                }
+            }
+        }
+    }
+    return graph.topLevel == topLevel && graph.levels[graph.entryPoint] == topLevel;
+}
+
+// Notes where every graph in the file starts. A missing or unreadable file leaves the store empty and every bucket is
+// built from scratch; the index stops at the first header that can't be read
+void openHnswStore(const std::string& path, HnswStore& store) {
+    store.path = path;
+    store.in.open(path, std::ios::binary);
+    char magic[sizeof(hnswMagic)] = {};
+    uint64_t graphs = 0;
+    if (!store.in.read(magic, sizeof(magic)) || std::memcmp(magic, hnswMagic, sizeof(magic)) != 0 || !store.in.read((char*)&graphs, sizeof(graphs))) {
+        return;
+    }
+    for (uint64_t g = 0; g < graphs; ++g) {
+        const uint64_t offset = (uint64_t)store.in.tellg();
+        uint64_t key = 0, nodes = 0, linkCount = 0;
+        int32_t m = 0, topLevel = 0;
+        uint32_t entryPoint = 0;
+        store.in.read((char*)&key, sizeof(key)).read((char*)&m, sizeof(m)).read((char*)&entryPoint, sizeof(entryPoint)).read((char*)&topLevel, sizeof(topLevel))
+            .read((char*)&nodes, sizeof(nodes)).read((char*)&linkCount, sizeof(linkCount));
+        if (!store.in || nodes > ((uint64_t)1 << 32) || linkCount > ((uint64_t)1 << 40)) {
+            return;
+        }
+        store.offsets[key] = offset;
+        store.in.seekg((std::streamoff)(nodes + linkCount * sizeof(uint32_t)), std::ios::cur);
+    }
+}
+
+// Reads the graph stored at offset into graph, false if it isn't a valid graph over count nodes (it is then rebuilt)
+bool readHnswGraph(HnswStore& store, const uint64_t offset, const size_t count, const HnswParameters& parameters, HnswGraph& graph) {
+    uint64_t key = 0, nodes = 0, linkCount = 0;
+    store.in.clear();
+    store.in.seekg((std::streamoff)offset);
+    store.in.read((char*)&key, sizeof(key)).read((char*)&graph.m, sizeof(graph.m)).read((char*)&graph.entryPoint, sizeof(graph.entryPoint))
+        .read((char*)&graph.topLevel, sizeof(graph.topLevel)).read((char*)&nodes, sizeof(nodes)).read((char*)&linkCount, sizeof(linkCount));
+    if (!store.in || nodes != count || graph.m != std::max(parameters.m, 2)) {
+        return false;
+    }
+    graph.levels.resize(0);
+    graph.levels.resize(nodes);
+    store.in.read((char*)graph.levels.begin(), nodes);
+    graph.allocateLinks();
+    if (!store.in || graph.links.size() != linkCount) {
+        return false;
+    }
+    store.in.read((char*)graph.links.begin(), linkCount * sizeof(uint32_t));
+    return store.in && validHnswGraph(graph, parameters);
+}
+
+// Starts path + ".new" with a placeholder graph count, filled in by closeHnswStore
+void startHnswOutput(HnswStore& store) {
+    const uint64_t graphs = 0;
+    store.out.open(store.path + ".new", std::ios::binary | std::ios::trunc);
+    store.out.write(hnswMagic, sizeof(hnswMagic)).write((const char*)&graphs, sizeof(graphs));
+}
+
+void writeHnswGraph(HnswStore& store, const uint64_t key, const HnswGraph& graph) {
+    if (!store.out.is_open()) {
+        startHnswOutput(store);
+    }
+    const uint64_t nodes = graph.nodes(), linkCount = graph.links.size();
+    store.out.write((const char*)&key, sizeof(key)).write((const char*)&graph.m, sizeof(graph.m)).write((const char*)&graph.entryPoint, sizeof(graph.entryPoint))
+        .write((const char*)&graph.topLevel, sizeof(graph.topLevel)).write((const char*)&nodes, sizeof(nodes)).write((const char*)&linkCount, sizeof(linkCount));
+    store.out.write((const char*)graph.levels.begin(), nodes).write((const char*)graph.links.begin(), linkCount * sizeof(uint32_t));
+}
+
+// Appends the stored graph at offset to the new file as it is, false if it can't be read back whole
+bool copyHnswGraph(HnswStore& store, const uint64_t offset) {
+    uint64_t key = 0, nodes = 0, linkCount = 0;
+    int32_t m = 0, topLevel = 0;
+    uint32_t entryPoint = 0;
+    store.in.clear();
+    store.in.seekg((std::streamoff)offset);
+    store.in.read((char*)&key, sizeof(key)).read((char*)&m, sizeof(m)).read((char*)&entryPoint, sizeof(entryPoint)).read((char*)&topLevel, sizeof(topLevel))
+        .read((char*)&nodes, sizeof(nodes)).read((char*)&linkCount, sizeof(linkCount));
+    if (!store.in) {
+        return false;
+    }
+    store.out.write((const char*)&key, sizeof(key)).write((const char*)&m, sizeof(m)).write((const char*)&entryPoint, sizeof(entryPoint))
+        .write((const char*)&topLevel, sizeof(topLevel)).write((const char*)&nodes, sizeof(nodes)).write((const char*)&linkCount, sizeof(linkCount));
+    char buffer[16384];
+    for (uint64_t remaining = nodes + linkCount * sizeof(uint32_t); remaining > 0 && store.in;) {
+        const size_t chunk = (size_t)std::min<uint64_t>(remaining, sizeof(buffer));
+        store.in.read(buffer, chunk);
+        store.out.write(buffer, chunk);
+        remaining -= chunk;
+    }
+    return (bool)store.in;
+}
+
+// A run that wrote no graph leaves the file alone. Otherwise the stored graphs it didn't use are carried over, so a scan
+// of a subdirectory or of fewer buckets keeps the rest, and the new file gets its graph count and replaces the old one
+bool closeHnswStore(HnswStore& store) {
+    if (store.written.empty()) {
+        store.in.close();
+        return true;
+    }
+    uint64_t graphs = store.written.size();
+    bool copied = true;
+    for (const auto& [key, offset] : store.offsets) {
+        if (copied && store.written.count(key) == 0) {
+            copied = copyHnswGraph(store, offset);
+            graphs++;
+        }
+    }
+    store.out.seekp(sizeof(hnswMagic)).write((const char*)&graphs, sizeof(graphs));
+    store.out.close();
+    store.in.close();
+    std::error_code error;
+    if (!copied || store.out.fail()) {
+        std::filesystem::remove(store.path + ".new", error);
+        return false;
+    }
+    std::filesystem::rename(store.path + ".new", store.path, error);
+    return !error;
+}
+
+// Fills graph with the bucket's graph from the store, or builds it if no stored graph matches, and appends it to the
+// new store file
+void hnswGraphFor(const float* vectors, const size_t count, const HnswParameters& parameters, const size_t searchBytes, HnswStore& store, HnswGraph& graph) {
+    const uint64_t key = hnswKey(vectors, count, parameters);
+    const auto stored = store.offsets.find(key);
+    if (stored == store.offsets.end() || !readHnswGraph(store, stored->second, count, parameters, graph)) {
+        buildHnswGraph(vectors, count, parameters, searchBytes, graph);
+    }
+    if (!store.path.empty() && store.written.insert(key).second) {
+        writeHnswGraph(store, key, graph);
+    }
+}
+
+// Smallest decode that still covers the network input: JPEGs are scaled in the DCT domain, other formats decode in full
+int reducedColorFlag(const std::filesystem::path& path, const int inputSize) {
+    const auto size = readHeaderDimensions(path);
+    switch (size ? reductionFactor(*size, inputSize) : 1) {
+        case 8: return cv::IMREAD_REDUCED_COLOR_8;
+        case 4: return cv::IMREAD_REDUCED_COLOR_4;
+        case 2: return cv::IMREAD_REDUCED_COLOR_2;
+        default: return cv::IMREAD_COLOR;
+    }
+}
+
+// Every worker of the embedding pool owns its network since a cv::dnn::Net can't run two forward passes at once.
+// Inputs are scaled with the ImageNet mean and (average) standard deviation most pretrained backbones expect
+cv::dnn::Net loadEmbeddingNet(const EmbeddingOptions& options, const cv::Mat& calibration) {
+    cv::dnn::Net net = cv::dnn::readNet(options.model);
+    net.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+    net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 6)
+    if (options.int8 && !calibration.empty()) {
+        net = net.quantize(std::vector<cv::Mat>{calibration}, CV_32F, CV_32F);
+    }
+#endif
+    return net;
+}
+
+cv::Mat embeddingBlob(const std::vector<cv::Mat>& images, const int inputSize) {
+    return cv::dnn::blobFromImages(images, 1 / (0.226 * 255), cv::Size(inputSize, inputSize), cv::Scalar(123.675, 116.28, 103.53), true, false);
+}
+
+// Runs the network over every file once, batch by batch on a pool of one worker per core, and leaves a unit-length
+// embedding per file in embeddings (dimensions floats each, all zero for files that couldn't be read). OpenCV's own
+// threading is turned off meanwhile so the workers don't oversubscribe the cores. Returns false if the model can't be
+// loaded
+bool computeEmbeddings(const PathTable& paths, const EmbeddingOptions& options, SpillVector<float>& embeddings, size_t& dimensions, SpillVector<uint8_t>& valid, ScanStats& stats, const std::function<void(size_t)>& progress) {
+    const auto start = std::chrono::steady_clock::now();
+    const size_t batch = (size_t)std::max(options.batch, 1);
+
+    // The first batch calibrates int8 quantization, and one forward pass tells how long the embeddings are
+    std::vector<cv::Mat> calibrationImages;
+    for (size_t file = 0; file < std::min(batch, paths.size()); ++file) {
+        const std::filesystem::path path(paths[file]);
+        cv::Mat image = cv::imread(path.string(), reducedColorFlag(path, options.inputSize));
+        if (image.data != nullptr) {
+            calibrationImages.push_back(image);
+        }
+    }
+    const cv::Mat calibration = calibrationImages.empty() ? cv::Mat() : embeddingBlob(calibrationImages, options.inputSize);
+    cv::dnn::Net probe;
+    try {
+        probe = loadEmbeddingNet(options, calibration);
+        if (probe.empty()) {
+            return false;
+        }
+        probe.setInput(embeddingBlob({cv::Mat(options.inputSize, options.inputSize, CV_8UC3, cv::Scalar::all(0))}, options.inputSize));
+        dimensions = probe.forward().total();
+    }
+    catch (const cv::Exception&) {
+        return false;
+    }
+    embeddings.resize(paths.size() * dimensions);
+    valid.resize(paths.size());
+
+    const size_t batches = (paths.size() + batch - 1) / batch;
+    const size_t workers = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), batches));
+    const int openCvThreads = cv::getNumThreads();
+    cv::setNumThreads(1);
+    std::atomic<size_t> nextBatch(0), done(0), failed(0);
+    auto embedBatches = [&](const size_t worker, cv::dnn::Net net) {
+        std::vector<cv::Mat> images;
+        std::vector<size_t> files;
+        for (size_t b = nextBatch++; b < batches; b = nextBatch++) {
+            images.clear();
+            files.clear();
+            for (size_t file = b * batch; file < std::min((b + 1) * batch, paths.size()); ++file) {
+                const std::filesystem::path path(paths[file]);
+                cv::Mat image = cv::imread(path.string(), reducedColorFlag(path, options.inputSize));
+                if (image.data != nullptr) {
+                    images.push_back(image);
+                    files.push_back(file);
+                }
+            }
+            if (!images.empty()) {
+                try {
+                    net.setInput(embeddingBlob(images, options.inputSize));
+                    const cv::Mat output = net.forward().reshape(1, (int)images.size());
+                    for (size_t i = 0; i < files.size(); ++i) {
+                        float* embedding = &embeddings[files[i] * dimensions];
+                        cv::Mat row(1, (int)dimensions, CV_32F, embedding);
+                        output.row((int)i).convertTo(row, CV_32F);
+                        const double norm = cv::norm(row, cv::NORM_L2);
+                        if (norm > 0) {
+                            row /= norm;
+                        }
+                        valid[files[i]] = 1;
+                    }
+                }
+                catch (const cv::Exception&) {
+                    failed += files.size();
+                }
+            }
+            failed += std::min((b + 1) * batch, paths.size()) - b * batch - files.size();
+            done += std::min((b + 1) * batch, paths.size()) - b * batch;
+            if (worker == 0) {
+                progress(done);
+            }
+        }
+    };
+
+    std::vector<std::future<void>> pool;
+    for (size_t worker = 1; worker < workers; ++worker) {
+        pool.push_back(std::async(std::launch::async, [&, worker]() { embedBatches(worker, loadEmbeddingNet(options, calibration)); }));
+    }
+    embedBatches(0, probe);
+    for (auto& worker : pool) {
+        worker.get();
+    }
+    cv::setNumThreads(openCvThreads);
+
+    stats.embeddedImages = paths.size() - failed;
+    stats.embeddingFailures = failed;
+    stats.embeddingCores = workers;
+    stats.embeddingSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+// Embedding mode: files (of any size) whose embeddings reach the embedding threshold match, with no pixel comparison.
+// Embeddings are packed down to the readable files and paired with the same blocked products as the cosine mode
+bool findEmbeddingMatches(const PathTable& paths, const ScanOptions& options, SpillVector<MatchEdge>& matches, ScanStats& stats, const std::function<void(size_t)>& progress) {
+    SpillVector<float> embeddings(options.budget.features);
+    size_t dimensions = 0;
+    SpillVector<uint8_t> valid(options.budget.embeddingFlags);
+    if (!computeEmbeddings(paths, options.embedding, embeddings, dimensions, valid, stats, progress)) {
+        return false;
+    }
+    SpillVector<uint32_t> files(options.budget.candidates);
+    for (size_t file = 0; file < paths.size(); ++file) {
+        if (valid[file]) {
+            std::memmove(&embeddings[files.size() * dimensions], &embeddings[file * dimensions], dimensions * sizeof(float));
+            files.push_back((uint32_t)file);
+        }
+    }
+    if (files.size() > 1) {
+        SpillVector<MatchEdge> pairs(options.budget.bucketPairs);
+        cosinePairs(cv::Mat((int)files.size(), (int)dimensions, CV_32F, embeddings.begin()), options.embedding.threshold, options.budget.candidateIndex, pairs);
+        for (const MatchEdge& pair : pairs) {
+            matches.push_back({files[pair.file1], files[pair.file2]});
+        }
+        reportSpilled(stats, {{"candidate pairs", pairs.spilled()}});
+    }
+    reportSpilled(stats, {{"embeddings", embeddings.spilled()}});
+    return true;
+}
+
+// Short side ORB works at: big enough for stable keypoints, small enough that extraction stays cheap
+const int orbMinSide = 320;
+// Bytes per ORB descriptor, nearest neighbours in other files kept per descriptor, neighbours queried to find them (the
+// descriptor itself and similar ones from its own file come back too) and the Hamming distance (of 256 bits) up to
+// which a neighbour counts as a vote
+const int orbDescriptorBytes = 32, orbNeighbours = 3, orbQueryNeighbours = 8, orbMaxVoteDistance = 64;
+
+struct OrbKeypoint {
+    float x, y;
+    uint32_t file;
+};
+
+// Keypoints and descriptors of every file, the descriptors as one contiguous matrix so the index is built over them
+// directly. Rows firstRow[f] up to firstRow[f + 1] belong to file f
+struct OrbFeatures {
+    explicit OrbFeatures(const size_t limitBytes) : keypoints(limitBytes / 3), descriptors(limitBytes / 2), firstRow(limitBytes / 6) {}
+
+    SpillVector<OrbKeypoint> keypoints;
+    SpillVector<uint8_t> descriptors;
+    SpillVector<uint64_t> firstRow;
+
+    cv::Mat rows(const size_t file) {
+        const int count = (int)(firstRow[file + 1] - firstRow[file]);
+        return count == 0 ? cv::Mat() : cv::Mat(count, orbDescriptorBytes, CV_8U, &descriptors[firstRow[file] * orbDescriptorBytes]);
+    }
+};
+
+void extractOrbFeatures(const PathTable& paths, const OrbOptions& options, OrbFeatures& features, const std::function<void(size_t)>& progress) {
+    const cv::Ptr<cv::ORB> orb = cv::ORB::create(options.features);
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    features.firstRow.push_back(0);
+    for (size_t file = 0; file < paths.size(); ++file) {
+        progress(file);
+        const std::filesystem::path path(paths[file]);
+        const auto size = readHeaderDimensions(path);
+        const cv::Mat image = cv::imread(path.string(), reducedGrayscaleFlag(size ? reductionFactor(*size, orbMinSide) : 1));
+        keypoints.clear();
+        descriptors.release();
+        if (image.data != nullptr) {
+            orb->detectAndCompute(image, cv::noArray(), keypoints, descriptors);
+        }
+        for (int i = 0; i < descriptors.rows; ++i) {
+            features.keypoints.push_back({keypoints[i].pt.x, keypoints[i].pt.y, (uint32_t)file});
+            const uchar* row = descriptors.ptr<uchar>(i);
+            for (int b = 0; b < orbDescriptorBytes; ++b) {
+                features.descriptors.push_back(row[b]);
+            }
+        }
+        features.firstRow.push_back(features.keypoints.size());
+    }
+}
+
+// Rough size of cv::flann's LSH index per descriptor: a slot in each of its 12 hash tables, about 32 bytes with the
+// hash map's overhead
+const size_t orbIndexBytesPerDescriptor = 12 * 32;
+// Fewest descriptors an LSH index chunk covers however small the budget, so a tiny share can't multiply the queries
+const size_t orbMinChunkRows = 1024;
+
+// One of the nearest neighbours found so far for a descriptor, -1 while the slot is empty. Rows are 64-bit since a
+// budgeted scan of millions of files can hold more than 2^31 descriptors
+struct OrbNeighbour {
+    int64_t row;
+    int32_t distance;
+};
+
+// Inserts a neighbour into a descriptor's slots, which are sorted by distance; earlier finds stay ahead on ties
+void insertOrbNeighbour(OrbNeighbour* nearest, OrbNeighbour candidate) {
+    for (int slot = 0; slot < orbNeighbours; ++slot) {
+        if (candidate.distance < nearest[slot].distance) {
+            std::swap(candidate, nearest[slot]);
+        }
+    }
+}
+
+// Files whose descriptors vote for each other as LSH nearest neighbours, indexed in chunks of half of indexBytes
+void orbCandidatePairs(OrbFeatures& features, const size_t files, const OrbOptions& options, const size_t indexBytes, SpillVector<MatchEdge>& pairs) {
+    const size_t descriptors = features.keypoints.size();
+    if (descriptors == 0) {
+        return;
+    }
+    SpillVector<OrbNeighbour> neighbours(indexBytes / 2);
+    neighbours.resize(descriptors * orbNeighbours);
+    std::fill(neighbours.begin(), neighbours.end(), OrbNeighbour{-1, std::numeric_limits<int32_t>::max()});
+    const size_t chunkLimit = indexBytes == 0 ? descriptors : std::max(indexBytes / 2 / orbIndexBytesPerDescriptor, orbMinChunkRows);
+    const size_t chunks = (descriptors + chunkLimit - 1) / chunkLimit;
+    const size_t chunkRows = (descriptors + chunks - 1) / chunks;
+    auto descriptorRows = [&](const size_t begin, const size_t end) {
+        return cv::Mat((int)(end - begin), orbDescriptorBytes, CV_8U, &features.descriptors[begin * orbDescriptorBytes]);
+    };
+
+    cv::Mat indices, distances;
+    for (size_t chunkBegin = 0; chunkBegin < descriptors; chunkBegin += chunkRows) {
+        const size_t chunkEnd = std::min(chunkBegin + chunkRows, descriptors);
+        cv::flann::Index index(descriptorRows(chunkBegin, chunkEnd), cv::flann::LshIndexParams(12, 20, 2), cvflann::FLANN_DIST_HAMMING);
+        const int k = (int)std::min<size_t>(orbQueryNeighbours, chunkEnd - chunkBegin);
+        for (size_t queryBegin = chunkBegin; queryBegin < descriptors; queryBegin += chunkRows) {
+            const size_t queryEnd = std::min(queryBegin + chunkRows, descriptors);
+            index.knnSearch(descriptorRows(queryBegin, queryEnd), indices, distances, k, cv::flann::SearchParams(32));
+            for (int i = 0; i < indices.rows; ++i) {
+                const int64_t query = (int64_t)(queryBegin + i);
+                const uint32_t queryFile = features.keypoints[query].file;
+                for (int c = 0; c < indices.cols; ++c) {
+                    if (indices.at<int>(i, c) < 0) {
+                        continue;
+                    }
+                    const int64_t found = (int64_t)chunkBegin + indices.at<int>(i, c);
+                    if (features.keypoints[found].file == queryFile) {
+                        continue;
+                    }
+                    insertOrbNeighbour(&neighbours[query * orbNeighbours], {found, distances.at<int>(i, c)});
+                    if (queryBegin != chunkBegin) {
+                        insertOrbNeighbour(&neighbours[found * orbNeighbours], {query, distances.at<int>(i, c)});
+                    }
+                }
+            }
+        }
+    }
+
+    std::map<uint32_t, int> votes;
+    for (size_t file = 0; file < files; ++file) {
+        votes.clear();
+        for (uint64_t descriptor = features.firstRow[file]; descriptor < features.firstRow[file + 1]; ++descriptor) {
+            for (int slot = 0; slot < orbNeighbours; ++slot) {
+                const OrbNeighbour& neighbour = neighbours[descriptor * orbNeighbours + slot];
+                if (neighbour.row >= 0 && neighbour.distance <= orbMaxVoteDistance) {
+                    votes[features.keypoints[neighbour.row].file]++;
+                }
+            }
+        }
+        for (const auto& [other, count] : votes) {
+            if (count >= options.minVotes) {
+                pairs.push_back({(uint32_t)std::min<size_t>(file, other), (uint32_t)std::max<size_t>(file, other)});
+            }
+        }
+    }
+    sortCandidatePairs(pairs);
+    MatchEdge* last = std::unique(pairs.begin(), pairs.end(), [](const MatchEdge& a, const MatchEdge& b) {
+        return a.file1 == b.file1 && a.file2 == b.file2;
+    });
+    pairs.resize(last - pairs.begin());
+}
 
-// Returns NULL optional if image load failed otherwise percentage similarity (different sizes of image automatically return 0)
-const std::optional<const double> compareImages(const std::string& imagePath1, const std::string& imagePath2) {
-    cv::Mat image1Mat = cv::imread(imagePath1, cv::IMREAD_UNCHANGED);
-    cv::Mat image2Mat = cv::imread(imagePath2, cv::IMREAD_UNCHANGED);
-    if (image1Mat.data == nullptr || image2Mat.data == nullptr) {
-        return std::nullopt;
+// Ratio-tested descriptor matches between the two files, confirmed when a RANSAC homography explains enough of them
+bool orbVerifyPair(OrbFeatures& features, const MatchEdge& pair, const OrbOptions& options, const cv::Ptr<cv::BFMatcher>& matcher) {
+    std::vector<std::vector<cv::DMatch>> matches;
+    matcher->knnMatch(features.rows(pair.file1), features.rows(pair.file2), matches, 2);
+    std::vector<cv::Point2f> points1, points2;
+    for (const auto& match : matches) {
+        if (match.size() == 2 && match[0].distance < 0.8f * match[1].distance) {
+            const OrbKeypoint& keypoint1 = features.keypoints[features.firstRow[pair.file1] + match[0].queryIdx];
+            const OrbKeypoint& keypoint2 = features.keypoints[features.firstRow[pair.file2] + match[0].trainIdx];
+            points1.push_back(cv::Point2f(keypoint1.x, keypoint1.y));
+            points2.push_back(cv::Point2f(keypoint2.x, keypoint2.y));
+        }
     }
+    if (points1.size() < (size_t)std::max(options.minInliers, 4)) {
+        return false;
+    }
+    cv::Mat inliers;
+    const cv::Mat homography = cv::findHomography(points1, points2, cv::RANSAC, 5.0, inliers);
+    return !homography.empty() && cv::countNonZero(inliers) >= options.minInliers;
+}
 
-    if (image1Mat.rows != image2Mat.rows || image1Mat.cols != image2Mat.cols) {
-        return 0;
+void findOrbMatches(const PathTable& paths, const ScanOptions& options, SpillVector<MatchEdge>& matches, ScanStats& stats, const std::function<void(size_t)>& extractProgress, const std::function<void(size_t, size_t)>& verifyProgress) {
+    auto start = std::chrono::steady_clock::now();
+    OrbFeatures features(options.budget.features);
+    extractOrbFeatures(paths, options.orb, features, extractProgress);
+    stats.orbKeypoints = features.keypoints.size();
+    stats.orbExtractSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    SpillVector<MatchEdge> pairs(options.budget.bucketPairs);
+    orbCandidatePairs(features, paths.size(), options.orb, options.budget.candidateIndex, pairs);
+    stats.candidatePairs = pairs.size();
+    stats.possiblePairs = paths.size() * (paths.size() - 1) / 2;
+    stats.candidateSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const cv::Ptr<cv::BFMatcher> matcher = cv::BFMatcher::create(cv::NORM_HAMMING);
+    for (size_t pair = 0; pair < pairs.size(); ++pair) {
+        verifyProgress(pair, pairs.size());
+        if (orbVerifyPair(features, pairs[pair], options.orb, matcher)) {
+            matches.push_back(pairs[pair]);
+        }
     }
 
-    cv::Mat diff;
-    cv::absdiff(image1Mat, image2Mat, diff);
-    if (!diff.isContinuous()) {
-        return 0;
+    reportSpilled(stats, {{"keypoints", features.keypoints.spilled() || features.descriptors.spilled() || features.firstRow.spilled()}, {"candidate pairs", pairs.spilled()}});
+}
+
+KERNEL_INLINE size_t countCloseBytes(const uint8_t* a, const uint8_t* b, const size_t length, const int tolerance) {
+    size_t close = 0;
+    for (size_t i = 0; i < length; ++i) {
+        close += std::abs((int)a[i] - (int)b[i]) <= tolerance;
     }
+    return close;
+}
+
+MULTIVERSION_KERNEL((), size_t, countCloseBytes, (const uint8_t* a, const uint8_t* b, const size_t length, const int tolerance), ((a, b, length, tolerance)))
 
-    std::vector<uchar> diffVec(diff.data, diff.data + diff.total() * diff.channels());
-    return (double)std::count_if(diffVec.begin(), diffVec.end(), [](uchar uc){ return uc == 0; }) / diffVec.size();
+using CloseBytesKernel = size_t (*)(const uint8_t*, const uint8_t*, size_t, int);
+
+CloseBytesKernel closeBytesKernel() {
+    return SELECT_KERNEL(CloseBytesKernel, countCloseBytes, ());
 }
 
-void addDuplicate(std::vector<std::vector<std::filesystem::path>>& vec, const std::filesystem::path& path1, const std::filesystem::path& path2) {
-    for (auto& group : vec) {
-        // Check if either path exists in a duplicate group already
-        if (std::find(group.begin(), group.end(), path1) != group.end()) {
-            // Path 1 is in a group
-            group.push_back(path2);
-            return;
+// Matches files of similar aspect ratio whose 32x32 thumbnails agree within normalizedPixelTolerance
+void findScaleNormalizedMatches(const PathTable& paths, const ScanOptions& options, SpillVector<MatchEdge>& matches, ScanStats& stats, const std::function<void(size_t)>& fingerprintProgress, const std::function<void(size_t, size_t)>& compareProgress) {
+    SpillVector<ImageFingerprint> fingerprints(options.budget.fingerprints);
+    SpillVector<NormalizedThumbnail> thumbnails(options.budget.features);
+    for (size_t file = 0; file < paths.size(); ++file) {
+        fingerprintProgress(file);
+        NormalizedThumbnail thumbnail = {};
+        fingerprints.push_back(fingerprintImage(paths[file], false, options.dihedral, nullptr, &thumbnail).value_or(ImageFingerprint()));
+        thumbnails.push_back(thumbnail);
+    }
+
+    SpillVector<uint32_t> candidates(options.budget.candidates);
+    for (size_t file = 0; file < fingerprints.size(); ++file) {
+        if (fingerprints[file].width > 0 && fingerprints[file].height > 0) {
+            candidates.push_back((uint32_t)file);
         }
-        else if (std::find(group.begin(), group.end(), path2) != group.end()) {
-            // Path 2 is in a group
-            group.push_back(path1);
-            return;
+    }
+    auto aspect = [&fingerprints](const uint32_t file) {
+        return (double)fingerprints[file].width / fingerprints[file].height;
+    };
+    std::sort(candidates.begin(), candidates.end(), [&aspect](const uint32_t a, const uint32_t b) {
+        return std::make_pair(aspect(a), a) < std::make_pair(aspect(b), b);
+    });
+
+    const CloseBytesKernel kernel = closeBytesKernel();
+    const size_t pixels = normalizedSide * normalizedSide;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        compareProgress(i, candidates.size());
+        const double limit = aspect(candidates[i]) * (1 + options.aspectTolerance);
+        for (size_t j = i + 1; j < candidates.size() && aspect(candidates[j]) <= limit; ++j) {
+            stats.possiblePairs++;
+            const size_t close = kernel(thumbnails[candidates[i]].pixels, thumbnails[candidates[j]].pixels, pixels, normalizedPixelTolerance);
+            if ((double)close / pixels >= options.threshold) {
+                const uint32_t file1 = std::min(candidates[i], candidates[j]), file2 = std::max(candidates[i], candidates[j]);
+                matches.push_back({file1, file2});
+            }
+        }
+    }
+
+    reportSpilled(stats, {{"fingerprints", fingerprints.spilled()}, {"normalized thumbnails", thumbnails.spilled()}, {"candidates", candidates.spilled()}});
+}
+
+// Candidate pairs of bucket members (first < second), sorted so the pair scan can walk them member by member. The
+// members' hashes or vectors are gathered into one array first, which spills past their share like the index built
+// over them; returns whether it did
+bool findCandidatePairs(const uint32_t* members, const size_t memberCount, const SpillVector<ImageFingerprint>& fingerprints, const SpillVector<ThumbnailVector>& vectors, HnswStore& hnswStore, const ScanOptions& options, SpillVector<MatchEdge>& pairs, ScanStats& stats) {
+    const auto start = std::chrono::steady_clock::now();
+    bool keysSpilled = false;
+    if (usesVectors(options.candidates)) {
+        SpillVector<ThumbnailVector> bucketVectors(options.budget.bucketKeys);
+        for (size_t i = 0; i < memberCount; ++i) {
+            bucketVectors.push_back(vectors[members[i]]);
+        }
+        float* data = bucketVectors.begin()->values;
+        if (options.candidates == CandidateMode::Hnsw) {
+            // A quarter of the index share goes to the build and search state, the rest to the graph itself
+            const size_t searchBytes = options.budget.candidateIndex / 4;
+            HnswGraph graph(options.budget.candidateIndex - searchBytes);
+            hnswGraphFor(data, memberCount, options.hnsw, searchBytes, hnswStore, graph);
+            hnswPairs(graph, data, memberCount, options.cosineThreshold, options.hnsw.efSearch, searchBytes, pairs);
+        }
+        else {
+            cosinePairs(cv::Mat((int)memberCount, thumbnailVectorLength, CV_32F, data), options.cosineThreshold, options.budget.candidateIndex, pairs);
+        }
+        keysSpilled = bucketVectors.spilled();
+    }
+    else {
+        SpillVector<uint64_t> hashes(options.budget.bucketKeys);
+        for (size_t i = 0; i < memberCount; ++i) {
+            hashes.push_back(fingerprints[members[i]].hash);
+        }
+        hashPairsKernel(options.candidates)(hashes.begin(), memberCount, options.hashRadius, options.budget.candidateIndex, pairs);
+        keysSpilled = hashes.spilled();
+    }
+    sortCandidatePairs(pairs);
+    stats.candidatePairs += pairs.size();
+    stats.possiblePairs += memberCount * (memberCount - 1) / 2;
+    stats.candidateSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return keysSpilled;
+}
+
+// Bucket by full-resolution dimensions: readable files sorted by size, each run of equal sizes is a bucket and only
+// files within a bucket are decoded at full resolution and compared
+void sortIntoSizeBuckets(const SpillVector<ImageFingerprint>& fingerprints, SpillVector<uint32_t>& candidates) {
+    for (size_t file = 0; file < fingerprints.size(); ++file) {
+        if (fingerprints[file].width > 0) {
+            candidates.push_back((uint32_t)file);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [&fingerprints](const uint32_t a, const uint32_t b) {
+        return std::tie(fingerprints[a].width, fingerprints[a].height, a) < std::tie(fingerprints[b].width, fingerprints[b].height, b);
+    });
+}
+
+// One past the last candidate in the bucket starting at bucketStart
+size_t sizeBucketEnd(const SpillVector<ImageFingerprint>& fingerprints, const SpillVector<uint32_t>& candidates, const size_t bucketStart) {
+    const ImageFingerprint& bucketSize = fingerprints[candidates[bucketStart]];
+    size_t bucketEnd = bucketStart + 1;
+    for (; bucketEnd < candidates.size(); ++bucketEnd) {
+        const ImageFingerprint& size = fingerprints[candidates[bucketEnd]];
+        if (size.width != bucketSize.width || size.height != bucketSize.height) {
+            break;
+        }
+    }
+    return bucketEnd;
+}
+
+// Pairs present in both sorted lists
+size_t countCommonPairs(const SpillVector<MatchEdge>& pairs, const SpillVector<MatchEdge>& expected) {
+    auto before = [](const MatchEdge& a, const MatchEdge& b) {
+        return std::tie(a.file1, a.file2) < std::tie(b.file1, b.file2);
+    };
+    size_t common = 0;
+    for (size_t a = 0, b = 0; a < pairs.size() && b < expected.size();) {
+        if (before(pairs[a], expected[b])) {
+            a++;
+        }
+        else if (before(expected[b], pairs[a])) {
+            b++;
+        }
+        else {
+            common++;
+            a++;
+            b++;
         }
     }
+    return common;
+}
+
+// Latency and recall of each candidate index against its exhaustive mode over every bucket (--benchmark-candidates)
+void benchmarkCandidates(const PathTable& paths, const ScanOptions& options) {
+    std::cout << "Fingerprinting " << paths.size() << " files...\n";
+    SpillVector<ImageFingerprint> fingerprints(options.budget.fingerprints);
+    SpillVector<ThumbnailVector> vectors(options.budget.vectors);
+    for (size_t file = 0; file < paths.size(); ++file) {
+        ThumbnailVector vector = {};
+        fingerprints.push_back(fingerprintImage(paths[file], true, options.dihedral, &vector).value_or(ImageFingerprint()));
+        vectors.push_back(vector);
+    }
+    SpillVector<uint32_t> candidates(options.budget.candidates);
+    sortIntoSizeBuckets(fingerprints, candidates);
+
+    using Clock = std::chrono::steady_clock;
+    const CandidateMode modes[] = {CandidateMode::BkTree, CandidateMode::MultiIndex};
+    const int radii[] = {0, 2, 4, 6, 8, 10, 12};
+    const int efSearches[] = {16, 32, 64, 128, 256};
+    size_t truthPairs[std::size(radii)] = {}, found[std::size(radii)][std::size(modes)] = {}, correct[std::size(radii)][std::size(modes)] = {};
+    double truthSeconds[std::size(radii)] = {}, seconds[std::size(radii)][std::size(modes)] = {};
+    size_t cosinePairCount = 0, hnswFound[std::size(efSearches)] = {}, hnswCorrect[std::size(efSearches)] = {};
+    double cosineSeconds = 0, buildSeconds = 0, hnswSeconds[std::size(efSearches)] = {};
+    for (size_t bucketStart = 0, bucketEnd = 0; bucketStart < candidates.size(); bucketStart = bucketEnd) {
+        bucketEnd = sizeBucketEnd(fingerprints, candidates, bucketStart);
+        const size_t count = bucketEnd - bucketStart;
+        if (count < 2) {
+            continue;
+        }
+
+        {
+            SpillVector<uint64_t> hashes(options.budget.bucketKeys);
+            for (size_t member = bucketStart; member < bucketEnd; ++member) {
+                hashes.push_back(fingerprints[candidates[member]].hash);
+            }
+            for (size_t radius = 0; radius < std::size(radii); ++radius) {
+                SpillVector<MatchEdge> expected(options.budget.bucketPairs / 2);
+                const auto truthStart = Clock::now();
+                hammingScanPairs(hashes.begin(), count, radii[radius], options.budget.candidateIndex, expected);
+                sortCandidatePairs(expected);
+                truthSeconds[radius] += std::chrono::duration<double>(Clock::now() - truthStart).count();
+                truthPairs[radius] += expected.size();
+
+                for (size_t mode = 0; mode < std::size(modes); ++mode) {
+                    SpillVector<MatchEdge> pairs(options.budget.bucketPairs / 2);
+                    const auto start = Clock::now();
+                    hashPairsKernel(modes[mode])(hashes.begin(), count, radii[radius], options.budget.candidateIndex, pairs);
+                    sortCandidatePairs(pairs);
+                    seconds[radius][mode] += std::chrono::duration<double>(Clock::now() - start).count();
+                    found[radius][mode] += pairs.size();
+                    correct[radius][mode] += countCommonPairs(pairs, expected);
+                }
+            }
+        }
+
+        // The graph is built once with the configured M and efConstruction, only the search breadth varies
+        SpillVector<ThumbnailVector> bucketVectors(options.budget.bucketKeys);
+        for (size_t member = bucketStart; member < bucketEnd; ++member) {
+            bucketVectors.push_back(vectors[candidates[member]]);
+        }
+        float* data = bucketVectors.begin()->values;
+        SpillVector<MatchEdge> expected(options.budget.bucketPairs / 2);
+        auto start = Clock::now();
+        cosinePairs(cv::Mat((int)count, thumbnailVectorLength, CV_32F, data), options.cosineThreshold, options.budget.candidateIndex, expected);
+        sortCandidatePairs(expected);
+        cosineSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+        cosinePairCount += expected.size();
+        start = Clock::now();
+        const size_t searchBytes = options.budget.candidateIndex / 4;
+        HnswGraph graph(options.budget.candidateIndex - searchBytes);
+        buildHnswGraph(data, count, options.hnsw, searchBytes, graph);
+        buildSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+        for (size_t ef = 0; ef < std::size(efSearches); ++ef) {
+            SpillVector<MatchEdge> pairs(options.budget.bucketPairs / 2);
+            start = Clock::now();
+            hnswPairs(graph, data, count, options.cosineThreshold, efSearches[ef], searchBytes, pairs);
+            hnswSeconds[ef] += std::chrono::duration<double>(Clock::now() - start).count();
+            hnswFound[ef] += pairs.size();
+            hnswCorrect[ef] += countCommonPairs(pairs, expected);
+        }
+    }
+
+    std::cout << std::left << std::setw(8) << "Radius" << std::setw(12) << "Index" << std::setw(12) << "Pairs" << std::setw(12) << "Recall"
+              << std::setw(12) << "Time (ms)" << "Scan (ms)\n";
+    for (size_t radius = 0; radius < std::size(radii); ++radius) {
+        for (size_t mode = 0; mode < std::size(modes); ++mode) {
+            std::cout << std::setw(8) << radii[radius] << std::setw(12) << candidateModeName(modes[mode]) << std::setw(12) << found[radius][mode] << std::setw(12)
+                      << std::fixed << std::setprecision(4) << (truthPairs[radius] > 0 ? (double)correct[radius][mode] / truthPairs[radius] : 1.0) << std::setw(12)
+                      << std::setprecision(3) << 1000 * seconds[radius][mode] << 1000 * truthSeconds[radius] << "\n";
+        }
+    }
+
+    std::cout << "\nHNSW (M " << options.hnsw.m << ", efConstruction " << options.hnsw.efConstruction << ", cosine at least " << options.cosineThreshold << ")\n";
+    std::cout << "Build " << std::setprecision(3) << 1000 * buildSeconds << " ms, cosine products " << 1000 * cosineSeconds << " ms\n";
+    std::cout << std::setw(12) << "efSearch" << std::setw(12) << "Pairs" << std::setw(12) << "Recall" << "Query (ms)\n";
+    for (size_t ef = 0; ef < std::size(efSearches); ++ef) {
+        std::cout << std::setw(12) << efSearches[ef] << std::setw(12) << hnswFound[ef] << std::setw(12) << std::setprecision(4)
+                  << (cosinePairCount > 0 ? (double)hnswCorrect[ef] / cosinePairCount : 1.0) << std::setprecision(3) << 1000 * hnswSeconds[ef] << "\n";
+    }
+}
+
+// Root of file's group, halving the path on the way so later lookups take fewer steps
+uint32_t findGroupRoot(SpillVector<uint32_t>& parents, uint32_t file) {
+    while (parents[file] != file) {
+        parents[file] = parents[parents[file]];
+        file = parents[file];
+    }
+    return file;
+}
 
-    // Neither do, so create a new group
-    vec.push_back(std::vector{path1, path2});
+// Groups the files joined by matches with a union-find, in the order of each group's first file
+std::vector<std::vector<std::filesystem::path>> groupMatches(const PathTable& paths, const SpillVector<MatchEdge>& matches, const size_t limitBytes, ScanStats& stats) {
+    SpillVector<uint32_t> parents(limitBytes);
+    parents.resize(paths.size());
+    for (size_t file = 0; file < paths.size(); ++file) {
+        parents[file] = (uint32_t)file;
+    }
+    for (size_t match = 0; match < matches.size(); ++match) {
+        const uint32_t root1 = findGroupRoot(parents, matches[match].file1);
+        const uint32_t root2 = findGroupRoot(parents, matches[match].file2);
+        parents[std::max(root1, root2)] = std::min(root1, root2);
+    }
+
+    std::map<uint32_t, std::vector<std::filesystem::path>> groups;
+    for (size_t file = 0; file < paths.size(); ++file) {
+        const uint32_t root = findGroupRoot(parents, (uint32_t)file);
+        if (root != file) {
+            auto& group = groups[root];
+            if (group.empty()) {
+                group.push_back(paths[root]);
+            }
+            group.push_back(paths[file]);
+        }
+    }
+    reportSpilled(stats, {{"match groups", parents.spilled()}});
+    std::vector<std::vector<std::filesystem::path>> duplicates;
+    for (auto& [root, group] : groups) {
+        duplicates.push_back(std::move(group));
+    }
+    return duplicates;
 }
 
 void compareImages(const std::vector<std::filesystem::path>& paths, const int largestDimension) {
@@ -119,14 +3796,13 @@ bool fileIsValid(const std::filesystem::path& path) {
     return false;
 };
 
-const std::set<std::filesystem::path> countFiles(const std::string& path, const bool recurse = false) {
-    std::set<std::filesystem::path> toSearch;
+void countFiles(PathTable& toSearch, const std::string& path, const bool recurse = false) {
     if (recurse) {
         for (const auto& file : std::filesystem::recursive_directory_iterator(path)) {
             if (!fileIsValid(file)) {
                 continue;
             }
-            toSearch.insert(file);
+            toSearch.add(file);
         }
     }
     else {
@@ -134,10 +3810,10 @@ const std::set<std::filesystem::path> countFiles(const std::string& path, const
             if (!fileIsValid(file)) {
                 continue;
             }
-            toSearch.insert(file);
+            toSearch.add(file);
         }
     }
-    return toSearch;
+    toSearch.sort();
 }
 
 int main(int argc, char** argv) {
@@ -156,6 +3832,191 @@ int main(int argc, char** argv) {
         .default_value(0.9)
         .action([](const std::string& value) { return std::stod(value); });
 
+    program.add_argument("--candidates")
+        .help("How candidate pairs are found: exhaustive (default, every same-size pair), bktree / mih / scan (pairs whose perceptual hashes are within --hash-radius bits), cosine (pairs whose 16x16 thumbnails are at least --cosine-threshold similar) or hnsw (the same pairs approximately, from a nearest-neighbour graph); all but exhaustive may miss duplicates")
+        .default_value(std::string("exhaustive"));
+
+    program.add_argument("--hash-radius")
+        .help("Largest Hamming distance between 64-bit perceptual hashes that makes a candidate pair (default 6)")
+        .default_value(6)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--cosine-threshold")
+        .help("Smallest cosine similarity between mean-removed 16x16 thumbnails that makes a candidate pair (default 0.95)")
+        .default_value(0.95)
+        .action([](const std::string& value) { return std::stod(value); });
+
+    program.add_argument("--hnsw-m")
+        .help("Links per node of the HNSW graph, twice that on its bottom level (default 16)")
+        .default_value(16)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--hnsw-ef-construction")
+        .help("Candidates considered while linking each node into the HNSW graph (default 200)")
+        .default_value(200)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--hnsw-ef-search")
+        .help("Nearest neighbours gathered per file when querying the HNSW graph, higher finds more pairs but is slower (default 64)")
+        .default_value(64)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--hnsw-index")
+        .help("File the HNSW graphs are loaded from and saved to, so unchanged buckets aren't rebuilt on the next run")
+        .default_value(std::string(""));
+
+    program.add_argument("--embedding-model")
+        .help("Compares files by the embeddings a CNN (any model cv::dnn::readNet loads) computes for them instead of by pixels, so crops, resizes and recompressions match")
+        .default_value(std::string(""));
+
+    program.add_argument("--embedding-size")
+        .help("Side of the square input the embedding model expects (default 224)")
+        .default_value(224)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--embedding-batch")
+        .help("Images per forward pass of the embedding model (default 32)")
+        .default_value(32)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--embedding-int8")
+        .help("Quantizes the embedding model to int8, calibrated on the first batch (OpenCV 4.6 or newer)")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--embedding-threshold")
+        .help("Smallest cosine similarity between embeddings that makes two files duplicates (default 0.9)")
+        .default_value(0.9)
+        .action([](const std::string& value) { return std::stod(value); });
+
+    program.add_argument("--orb")
+        .help("Matches files by ORB keypoints confirmed with a RANSAC homography instead of by pixels, so cropped and rotated copies are found")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--orb-features")
+        .help("ORB keypoints extracted per file (default 500)")
+        .default_value(500)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--orb-votes")
+        .help("Close descriptor neighbours two files must share to be checked with RANSAC (default 12)")
+        .default_value(12)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--orb-inliers")
+        .help("Homography inliers that confirm two files as duplicates (default 15)")
+        .default_value(15)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--benchmark-candidates")
+        .help("Times the hash indexes against the exhaustive Hamming scan at several radii, prints their recall and exits")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--dihedral")
+        .help("Also finds copies that were rotated by quarter turns or mirrored, by turning every image to a canonical orientation picked from its thumbnail's brightness moments. Images that are close to symmetric under a turn or mirror may be oriented differently in different copies and missed")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--scale-normalized")
+        .help("Finds resized copies by comparing 32x32 thumbnails of files with about the same aspect ratio instead of full-resolution pixels of files with the same size")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--aspect-tolerance")
+        .help("Relative difference in aspect ratio --scale-normalized still compares (default 0.01)")
+        .default_value(0.01)
+        .action([](const std::string& value) { return std::stod(value); });
+
+    program.add_argument("--pyramid")
+        .help("Compares coarse block-sum levels of each pair first and only compares at full resolution when they can't rule the pair out (in buckets of more than two files, a lone pair is compared directly)")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--cpu-features")
+        .help("Prints which variant (or single build) each kernel runs as on this CPU and exits")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--estimate")
+        .help("Decides pairs from a stratified sample of pixel elements and only scans every element when the confidence interval straddles the threshold")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--estimate-samples")
+        .help("Number of pixel elements sampled per pair by --estimate (default 4096)")
+        .default_value(4096)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--pixel-tolerance")
+        .help("Counts 8/16-bit samples that differ by at most this many 8-bit levels as equal, so lossy re-encodes can reach the threshold (default 0, exact; pairs of other depths score 0)")
+        .default_value(0)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--error-metrics")
+        .help("Reports the mean absolute error and PSNR of matched pairs, measured in the same pass as the similarity")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--ssim")
+        .help("Scores 8/16-bit pairs by mean SSIM over 8x8 windows instead of the fraction of equal samples, so --threshold applies to SSIM (pairs of other depths score 0)")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--ignore-transparent")
+        .help("Counts pixels that are fully transparent in both images as equal, so RGBA copies differing only under alpha 0 match")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--normalize-formats")
+        .help("Compares same-size images saved as RGB, RGBA, gray or 16-bit as 8-bit colour plus alpha instead of treating them as different")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--container-hash")
+        .help("Matches JPEGs and PNGs whose scan data or image data chunks are byte-identical before decoding anything, so copies that only differ in EXIF/XMP/ICC or text chunks group in one pass")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--memory-budget")
+        .help("Megabytes the per-file tables (30%), ORB, embedding and scale-normalized features (10%), candidate lists and indexes (10%), match list (10%), signatures (15%) and image cache (25%) may use before spilling to temporary files or skipping signatures (default 0, unbounded)")
+        .default_value(0)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--cache-size")
+        .help("Megabytes of decoded images kept between the pairs of a bucket (default 0, no cache)")
+        .default_value(0)
+        .action([](const std::string& value) { return std::stoi(value); });
+
+    program.add_argument("--cache-compress")
+        .help("Stores cached images LZ4-compressed so more of them fit in --cache-size")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--pyramid-margin")
+        .help("Rejects pairs whose coarse similarity bound is below threshold + margin (default 0.0 never rejects a real duplicate)")
+        .default_value(0.0)
+        .action([](const std::string& value) { return std::stod(value); });
+
+    program.add_argument("--summary-only")
+        .help("Prints the scan summary and every group of duplicates, then exits instead of opening the interactive menu")
+        .default_value(false)
+        .implicit_value(true);
+
+#if defined(COUNT_ALLOCATIONS)
+    static CountingMatAllocator countingMatAllocator;
+    cv::Mat::setDefaultAllocator(&countingMatAllocator);
+#endif
+
+    // Diagnostics that don't need a path are handled before the parser insists on one
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--cpu-features") {
+            printCpuFeatures();
+            exit(0);
+        }
+    }
+
     try {
         program.parse_args(argc, argv);
     }
@@ -182,17 +4043,170 @@ int main(int argc, char** argv) {
     if (program.get<bool>("-r")) {
         std::cout << "Recursion enabled\n";
     }
-    double threshold = std::clamp(program.get<double>("-t"), 0.1, 1.0);
-    if (threshold != 0.9) {
-        std::cout << "Threshold set to " << threshold << "\n";
+    ScanOptions options;
+    options.threshold = std::clamp(program.get<double>("-t"), 0.1, 1.0);
+    if (options.threshold != 0.9) {
+        std::cout << "Threshold set to " << options.threshold << "\n";
+    }
+    const std::string candidateMode = program.get<std::string>("--candidates");
+    if (candidateMode == "bktree") {
+        options.candidates = CandidateMode::BkTree;
+    }
+    else if (candidateMode == "mih") {
+        options.candidates = CandidateMode::MultiIndex;
+    }
+    else if (candidateMode == "scan") {
+        options.candidates = CandidateMode::HammingScan;
+    }
+    else if (candidateMode == "cosine") {
+        options.candidates = CandidateMode::Cosine;
+    }
+    else if (candidateMode == "hnsw") {
+        options.candidates = CandidateMode::Hnsw;
+    }
+    else if (candidateMode != "exhaustive") {
+        std::cout << "Unknown candidate mode \"" << candidateMode << "\"\n";
+        exit(1);
+    }
+    options.hashRadius = std::clamp(program.get<int>("--hash-radius"), 0, 64);
+    options.cosineThreshold = std::clamp(program.get<double>("--cosine-threshold"), -1.0, 1.0);
+    options.hnsw.m = std::clamp(program.get<int>("--hnsw-m"), 2, 100);
+    options.hnsw.efConstruction = std::max(program.get<int>("--hnsw-ef-construction"), 1);
+    options.hnsw.efSearch = std::max(program.get<int>("--hnsw-ef-search"), 1);
+    options.hnswIndexPath = program.get<std::string>("--hnsw-index");
+    if (usesHashes(options.candidates)) {
+        std::cout << "Finding candidates with a " << candidateMode << " index (radius " << options.hashRadius << ")\n";
+    }
+    else if (options.candidates == CandidateMode::Cosine) {
+        std::cout << "Finding candidates by thumbnail cosine similarity (at least " << options.cosineThreshold << ")\n";
+    }
+    else if (options.candidates == CandidateMode::Hnsw) {
+        std::cout << "Finding candidates with an HNSW graph (M " << options.hnsw.m << ", efConstruction " << options.hnsw.efConstruction << ", efSearch "
+                  << options.hnsw.efSearch << ", cosine at least " << options.cosineThreshold << ")\n";
+    }
+    options.embedding.model = program.get<std::string>("--embedding-model");
+    options.embedding.inputSize = std::max(program.get<int>("--embedding-size"), 1);
+    options.embedding.batch = std::max(program.get<int>("--embedding-batch"), 1);
+    options.embedding.int8 = program.get<bool>("--embedding-int8");
+    options.embedding.threshold = std::clamp(program.get<double>("--embedding-threshold"), -1.0, 1.0);
+    if (options.embedding.model.size() > 0) {
+        bool loaded = false;
+        try {
+            loaded = !cv::dnn::readNet(options.embedding.model).empty();
+        }
+        catch (const cv::Exception&) {}
+        if (!loaded) {
+            std::cout << "Couldn't load embedding model \"" << options.embedding.model << "\"\n";
+            exit(1);
+        }
+        std::cout << "Comparing embeddings from " << options.embedding.model << " (cosine at least " << options.embedding.threshold << ")\n";
+#if CV_VERSION_MAJOR < 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR < 6)
+        if (options.embedding.int8) {
+            std::cout << "This OpenCV can't quantize networks, the embedding model will run in float\n";
+        }
+#endif
+    }
+    options.orb.enabled = program.get<bool>("--orb");
+    options.orb.features = std::max(program.get<int>("--orb-features"), 1);
+    options.orb.minVotes = std::max(program.get<int>("--orb-votes"), 1);
+    options.orb.minInliers = std::max(program.get<int>("--orb-inliers"), 4);
+    if (options.orb.enabled && options.embedding.model.size() > 0) {
+        std::cout << "--orb and --embedding-model are separate modes, pick one\n";
+        exit(1);
+    }
+    if (options.orb.enabled) {
+        std::cout << "Matching ORB keypoints (" << options.orb.features << " per file, " << options.orb.minInliers << " inliers to confirm)\n";
+    }
+    options.dihedral = program.get<bool>("--dihedral");
+    if (options.dihedral) {
+        std::cout << "Rotated and mirrored copies will be matched\n";
+    }
+    options.scaleNormalized = program.get<bool>("--scale-normalized");
+    options.aspectTolerance = std::clamp(program.get<double>("--aspect-tolerance"), 0.0, 1.0);
+    if (options.scaleNormalized && (options.orb.enabled || options.embedding.model.size() > 0)) {
+        std::cout << "--scale-normalized, --orb and --embedding-model are separate modes, pick one\n";
+        exit(1);
+    }
+    if (options.scaleNormalized) {
+        std::cout << "Comparing scale-normalized thumbnails (aspect ratios within " << 100 * options.aspectTolerance << "%)\n";
+    }
+    options.pyramid = program.get<bool>("--pyramid");
+    options.pyramidMargin = program.get<double>("--pyramid-margin");
+    if (options.pyramid) {
+        std::cout << "Pyramid comparison enabled\n";
+    }
+    options.budget = splitMemoryBudget((size_t)std::max(program.get<int>("--memory-budget"), 0) << 20);
+    options.cacheBytes = (size_t)std::max(program.get<int>("--cache-size"), 0) << 20;
+    if (options.budget.imageCache > 0) {
+        options.cacheBytes = std::min(options.cacheBytes, options.budget.imageCache);
+    }
+    options.cacheCompress = program.get<bool>("--cache-compress");
+#if !defined(HAVE_LZ4)
+    if (options.cacheCompress) {
+        std::cout << "Built without LZ4, cached images will be stored uncompressed\n";
+        options.cacheCompress = false;
+    }
+#endif
+    if (program.get<int>("--memory-budget") > 0) {
+        std::cout << "Memory budget set to " << program.get<int>("--memory-budget") << " MB\n";
+    }
+    if (options.cacheBytes > 0) {
+        std::cout << "Image cache set to " << (options.cacheBytes >> 20) << " MB" << (options.cacheCompress ? " (LZ4-compressed)" : "") << "\n";
+    }
+    options.estimate = program.get<bool>("--estimate");
+    options.estimateSamples = std::max(program.get<int>("--estimate-samples"), 1);
+    if (options.estimate) {
+        std::cout << "Sampling estimator enabled (" << options.estimateSamples << " samples per pair)\n";
+    }
+    options.pixelTolerance = std::clamp(program.get<int>("--pixel-tolerance"), 0, 255);
+    options.errorMetrics = program.get<bool>("--error-metrics");
+    if (options.pixelTolerance > 0) {
+        std::cout << "Pixel tolerance set to " << options.pixelTolerance << " level" << (options.pixelTolerance == 1 ? "" : "s") << " (histogram, pyramid and sampling shortcuts are off)\n";
+    }
+    options.ssim = program.get<bool>("--ssim");
+    if (options.ssim && (options.pixelTolerance > 0 || options.errorMetrics)) {
+        std::cout << "--ssim replaces the equal-sample metric that --pixel-tolerance and --error-metrics apply to, pick one\n";
+        exit(1);
+    }
+    if (options.ssim) {
+        std::cout << "Scoring pairs by SSIM (histogram, pyramid and sampling shortcuts are off)\n";
+    }
+    options.ignoreTransparent = program.get<bool>("--ignore-transparent");
+    if (options.ignoreTransparent && (options.ssim || options.pixelTolerance > 0 || options.errorMetrics)) {
+        std::cout << "--ignore-transparent only applies to the exact equal-sample metric\n";
+        exit(1);
+    }
+    if (options.ignoreTransparent) {
+        std::cout << "Fully transparent pixels will be ignored (histogram, pyramid and sampling shortcuts are off)\n";
+    }
+    options.containerHash = program.get<bool>("--container-hash");
+    if (options.containerHash && (options.scaleNormalized || options.orb.enabled || options.embedding.model.size() > 0)) {
+        std::cout << "--container-hash only applies to the pixel comparison, not --scale-normalized, --orb or --embedding-model\n";
+        exit(1);
+    }
+    if (options.containerHash) {
+        std::cout << "Files with identical JPEG scan data or PNG image data will be matched without decoding\n";
+    }
+    options.normalizeFormats = program.get<bool>("--normalize-formats");
+    if (options.normalizeFormats && !exactEqualityMetric(options)) {
+        std::cout << "--normalize-formats only applies to the exact equal-sample metric\n";
+        exit(1);
+    }
+    if (options.normalizeFormats) {
+        std::cout << "Copies saved in other channel layouts or bit depths will be compared\n";
     }
     std::cout << "Counting files... this might take a while!\n";
-    auto paths = countFiles(path, program.get<bool>("-r"));
+    PathTable paths(options.budget.paths);
+    countFiles(paths, path, program.get<bool>("-r"));
     std::cout << "Found " << paths.size() << " file" << (paths.size() == 1 ? "" : "s") << "\n";
     if (paths.size() <= 1) {
         std::cout << "Didn't find enough files to compare\nExiting...\n";
         exit(0);
     }
+    if (program.get<bool>("--benchmark-candidates")) {
+        benchmarkCandidates(paths, options);
+        exit(0);
+    }
     std::cout << "Starting file comparison\n";
     using namespace indicators;
     show_console_cursor(false);
@@ -222,39 +4236,215 @@ int main(int argc, char** argv) {
 
     MultiProgress<ProgressBar, 2> bars(currentFile, compareFile);
 
-    auto findDuplicates = [&bars, &compareFile, path, &paths](const bool recurse, const double threshold) -> std::vector<std::vector<std::filesystem::path>> {
-        std::vector<std::vector<std::filesystem::path>> duplicates;
-        std::set<std::filesystem::path> toCompare(paths);
+    ScanStats stats;
+    auto findDuplicates = [&bars, &compareFile, path, &paths, &stats](const bool recurse, const ScanOptions& options) -> std::vector<std::vector<std::filesystem::path>> {
+        if (options.scaleNormalized) {
+            SpillVector<MatchEdge> matches(options.budget.matches);
+            findScaleNormalizedMatches(paths, options, matches, stats, [&bars, &paths](const size_t file) {
+                bars.set_progress<0>(100 * file / paths.size());
+            }, [&bars](const size_t file, const size_t files) {
+                bars.set_progress<0>(size_t(100));
+                bars.set_progress<1>(100 * file / files);
+            });
+            reportSpilled(stats, {{"matches", matches.spilled()}});
+            bars.set_progress<0>(size_t(100));
+            bars.set_progress<1>(size_t(100));
+            return groupMatches(paths, matches, options.budget.groups, stats);
+        }
+        if (options.orb.enabled) {
+            SpillVector<MatchEdge> matches(options.budget.matches);
+            findOrbMatches(paths, options, matches, stats, [&bars, &paths](const size_t file) {
+                bars.set_progress<0>(100 * file / paths.size());
+            }, [&bars](const size_t pair, const size_t pairs) {
+                bars.set_progress<0>(size_t(100));
+                bars.set_progress<1>(100 * pair / pairs);
+            });
+            reportSpilled(stats, {{"matches", matches.spilled()}});
+            bars.set_progress<0>(size_t(100));
+            bars.set_progress<1>(size_t(100));
+            return groupMatches(paths, matches, options.budget.groups, stats);
+        }
+        if (options.embedding.model.size() > 0) {
+            SpillVector<MatchEdge> matches(options.budget.matches);
+            findEmbeddingMatches(paths, options, matches, stats, [&bars, &paths](const size_t done) {
+                bars.set_progress<0>(100 * done / paths.size());
+            });
+            reportSpilled(stats, {{"matches", matches.spilled()}});
+            bars.set_progress<0>(size_t(100));
+            bars.set_progress<1>(size_t(100));
+            return groupMatches(paths, matches, options.budget.groups, stats);
+        }
+
+        // Files whose pixel data is byte-identical to an earlier file's are matched to it straight away
+        SpillVector<MatchEdge> matches(options.budget.matches);
+        SpillVector<uint32_t> representatives(options.budget.representatives);
+        if (options.containerHash) {
+            findContainerDuplicates(paths, options.budget, representatives, matches, stats, [&bars, &paths](const size_t done) {
+                bars.set_progress<1>(100 * done / paths.size());
+            });
+        }
+
+        // Fingerprint every file once, unreadable files and those with a representative stay out of the buckets
+        const bool withVectors = usesVectors(options.candidates);
+        SpillVector<ImageFingerprint> fingerprints(options.budget.fingerprints);
+        SpillVector<ThumbnailVector> vectors(options.budget.vectors);
+        for (size_t file = 0; file < paths.size(); ++file) {
+            bars.set_progress<1>(100 * file / paths.size());
+            ThumbnailVector vector = {};
+            if (options.containerHash && representatives[file] != file) {
+                fingerprints.push_back(ImageFingerprint());
+                if (withVectors) {
+                    vectors.push_back(vector);
+                }
+                continue;
+            }
+            fingerprints.push_back(fingerprintImage(paths[file], usesHashes(options.candidates), options.dihedral, withVectors ? &vector : nullptr).value_or(ImageFingerprint()));
+            if (withVectors) {
+                vectors.push_back(vector);
+            }
+        }
+
+        SpillVector<uint32_t> candidates(options.budget.candidates);
+        sortIntoSizeBuckets(fingerprints, candidates);
+
+        HnswStore hnswStore;
+        if (options.candidates == CandidateMode::Hnsw && !options.hnswIndexPath.empty()) {
+            openHnswStore(options.hnswIndexPath, hnswStore);
+        }
+
+        ComparisonScratch scratch;
+        DecodedImageCache cache(options.cacheBytes, options.cacheCompress);
         size_t outerCount = 0;
-        for (const auto& path : paths) {
-            bars.set_progress<0>(100 * outerCount / paths.size());
-            toCompare.erase(toCompare.begin());
-            size_t innerCount = 0;
-            for (const auto& compare : toCompare) {
-                bars.set_progress<1>(100 * innerCount / toCompare.size());
-                if (compareImages(path.string(), compare.string()) >= threshold) {
-                    addDuplicate(duplicates, path, compare);
+        bool keysSpilled = false, pairsSpilled = false;
+        for (size_t bucketStart = 0, bucketEnd = 0; bucketStart < candidates.size(); bucketStart = bucketEnd) {
+            bucketEnd = sizeBucketEnd(fingerprints, candidates, bucketStart);
+            const uint32_t* members = &candidates[bucketStart];
+            const size_t memberCount = bucketEnd - bucketStart;
+
+            // Signatures are built lazily, only in buckets of more than two files, within their share of the budget
+            const bool useSignatures = memberCount > 2 && exactEqualityMetric(options);
+            std::map<uint32_t, PixelSignature> signatures;
+            SpillVector<uint8_t> signatureAttempted(options.budget.signatures / 16);
+            if (useSignatures) {
+                signatureAttempted.resize(memberCount);
+            }
+            const size_t signatureLimit = options.budget.signatures - options.budget.signatures / 16;
+            size_t signatureMemory = 0;
+            auto signatureFor = [&](const size_t member) -> const PixelSignature* {
+                if (!signatureAttempted[member]) {
+                    signatureAttempted[member] = 1;
+                    if (signatureLimit > 0 && signatureMemory >= signatureLimit) {
+                        stats.signaturesSkipped++;
+                    }
+                    else if (loadImage(paths, members[member], scratch.file1, scratch.image1, cache, stats, fingerprints[members[member]].orientation, scratch.oriented)) {
+                        const PixelSignature& signature = signatures.emplace((uint32_t)member, buildPixelSignature(scratch.image1, options)).first->second;
+                        signatureMemory += signatureBytes(signature) + signatureNodeBytes;
+                    }
+                }
+                const auto signature = signatures.find((uint32_t)member);
+                return signature != signatures.end() ? &signature->second : nullptr;
+            };
+
+            // Hash indexes hand over only the pairs worth verifying, otherwise every pair in the bucket is tried
+            SpillVector<MatchEdge> bucketPairs(options.budget.bucketPairs);
+            if (options.candidates != CandidateMode::Exhaustive && memberCount > 1) {
+                keysSpilled |= findCandidatePairs(members, memberCount, fingerprints, vectors, hnswStore, options, bucketPairs, stats);
+                pairsSpilled |= bucketPairs.spilled();
+            }
+
+            // Once the bucket's first pair has sized the scratch Mats, decoding the rest shouldn't create pixel buffers
+            size_t verified = 0;
+            auto comparePair = [&](const size_t i, const size_t j) {
+                const PixelSignature* signature1 = useSignatures ? signatureFor(i) : nullptr;
+                const PixelSignature* signature2 = useSignatures ? signatureFor(j) : nullptr;
+                if (signature1 != nullptr && signature2 != nullptr) {
+                    if (histogramRejects(*signature1, *signature2, options.threshold)) {
+                        stats.histogramPruned++;
+                        return;
+                    }
+                    if (options.pyramid) {
+                        const size_t level = pyramidRejectionLevel(*signature1, *signature2, options);
+                        if (level < pyramidLevels.size()) {
+                            stats.pyramidRejected[level]++;
+                            return;
+                        }
+                        stats.fullResolution++;
+                    }
+                }
+                const size_t matBuffers = stats.decodeMatBuffers;
+                const std::optional<const double> similarity = verifyPair(paths, members[i], members[j], signature1, signature2, scratch, cache, options, stats, fingerprints[members[i]].orientation, fingerprints[members[j]].orientation);
+                if (verified++ > 0) {
+                    stats.warmMatBuffers += stats.decodeMatBuffers - matBuffers;
+                }
+                if (similarity >= options.threshold) {
+                    matches.push_back({members[i], members[j]});
+                    if (options.errorMetrics && scratch.measured) {
+                        stats.measuredPairs++;
+                        stats.absoluteErrorSum += scratch.meanAbsoluteError;
+                        stats.lowestPsnr = std::min(stats.lowestPsnr, scratch.psnr);
+                    }
+                }
+            };
+
+            size_t pairCursor = 0;
+            for (size_t i = 0; i < memberCount; ++i) {
+                bars.set_progress<0>(100 * outerCount / candidates.size());
+                if (options.candidates == CandidateMode::Exhaustive) {
+                    for (size_t j = i + 1; j < memberCount; ++j) {
+                        bars.set_progress<1>(100 * (j - i - 1) / (memberCount - i - 1));
+                        comparePair(i, j);
+                    }
+                }
+                else {
+                    for (; pairCursor < bucketPairs.size() && bucketPairs[pairCursor].file1 == i; ++pairCursor) {
+                        bars.set_progress<1>(100 * (bucketPairs[pairCursor].file2 - i - 1) / (memberCount - i - 1));
+                        comparePair(i, bucketPairs[pairCursor].file2);
+                    }
                 }
-                innerCount++;
+                outerCount++;
             }
-            outerCount++;
         }
+
+        if (options.candidates == CandidateMode::Hnsw && !options.hnswIndexPath.empty() && !closeHnswStore(hnswStore)) {
+            stats.hnswSaveFailed = true;
+        }
+
+        std::vector<std::vector<std::filesystem::path>> duplicates = groupMatches(paths, matches, options.budget.groups, stats);
+
+        reportSpilled(stats, {{"file paths", paths.spilled()}, {"representatives", representatives.spilled()}, {"fingerprints", fingerprints.spilled()}, {"thumbnail vectors", vectors.spilled()}, {"candidates", candidates.spilled()}, {"bucket hashes or vectors", keysSpilled}, {"candidate pairs", pairsSpilled}, {"matches", matches.spilled()}});
         bars.set_progress<0>(size_t(100));
         bars.set_progress<1>(size_t(100));
         return duplicates;
     };
     
-    std::future<std::vector<std::vector<std::filesystem::path>>> ret = std::async(findDuplicates, program.get<bool>("-r"), threshold);
+    std::future<std::vector<std::vector<std::filesystem::path>>> ret = std::async(findDuplicates, program.get<bool>("-r"), options);
     auto duplicates = ret.get();
 
     show_console_cursor(true);
+    const std::string scanSummary = describeScanStats(options, stats);
     if (duplicates.size() == 0) {
+        if (scanSummary.size() > 0) {
+            std::cout << scanSummary << "\n";
+        }
         std::cout << "No duplicates found\n";
         exit(0);
     }
+    if (program.get<bool>("--summary-only")) {
+        if (scanSummary.size() > 0) {
+            std::cout << scanSummary << "\n";
+        }
+        std::cout << "Found " << duplicates.size() << " group" << (duplicates.size() == 1 ? "" : "s") << " of duplicates\n";
+        for (size_t i = 0; i < duplicates.size(); ++i) {
+            std::cout << "=== GROUP " << i << " ===\n";
+            for (const auto& duplicate : duplicates[i]) {
+                std::cout << duplicate.string() << "\n";
+            }
+        }
+        exit(0);
+    }
 
     int selectedGroup = -1, largestDimension = 1000;
-    std::string stringFlag = "";
+    std::string stringFlag = scanSummary;
     while (true) {
         clearTerminal();
         std::cout << "=== Image Duplicate Detector (C++ Edition) | Jack Hogan 2021 ===\n";
@@ -288,7 +4478,10 @@ int main(int argc, char** argv) {
 
         stringFlag = "";
         std::string command;
-        std::getline(std::cin, command);
+        // Closed stdin quits like q would
+        if (!std::getline(std::cin, command)) {
+            exit(0);
+        }
         if (command == "q") {
             if (selectedGroup == -1) {
                 exit(0);